@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "crc.h"
+#include "encoder.h"
+#include "queue.h"
+#include "server.h"
+#include "tokenizer.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono/chrono.hpp>
+#include <boost/crc.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <queue>
+#include <string>
+#include <vector>
+
+/*
+ * Standalone microbenchmarks for the CRC engine, the callback queue, the
+ * command tokenizer and the command encoder. Each path is measured
+ * against the code it replaced. Not part of the plugin build; run "make
+ * run" in this directory.
+ */
+
+namespace
+{
+	const std::size_t crcBytes = 64 * 1024 * 1024;
+	const int crcRounds = 8;
+	const int lineRounds = 2000000;
+	const int queueItems = 1000000;
+	const int queueProducers = 4;
+
+	volatile unsigned long sink = 0;
+
+	double getSeconds(boost::chrono::steady_clock::time_point start)
+	{
+		return boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+	}
+
+	void report(const char *name, double count, const char *unit, double seconds)
+	{
+		std::printf("%-36s %10.2f %s\n", name, count / seconds, unit);
+	}
+
+	void benchChecksum()
+	{
+		std::vector<char> data(crcBytes);
+		for (std::size_t i = 0; i < data.size(); ++i)
+		{
+			data[i] = static_cast<char>(std::rand());
+		}
+		boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+		boost::uint32_t checksum = 0;
+		for (int i = 0; i < crcRounds; ++i)
+		{
+			checksum = CRC::calculate(&data.front(), data.size(), checksum);
+		}
+		double seconds = getSeconds(start);
+		std::printf("CRC engine: %s\n", CRC::getEngineName());
+		report("crc engine", static_cast<double>(crcBytes) * crcRounds / 1e9, "GB/s", seconds);
+		start = boost::chrono::steady_clock::now();
+		boost::crc_32_type reference;
+		for (int i = 0; i < crcRounds; ++i)
+		{
+			reference.process_bytes(&data.front(), data.size());
+		}
+		seconds = getSeconds(start);
+		report("crc boost::crc_32_type", static_cast<double>(crcBytes) * crcRounds / 1e9, "GB/s", seconds);
+		if (checksum != reference.checksum())
+		{
+			std::printf("crc mismatch: %08x != %08x\n", checksum, reference.checksum());
+			std::exit(EXIT_FAILURE);
+		}
+	}
+
+	void produceQueue(Queue<int> *queue)
+	{
+		for (int i = 0; i < queueItems; ++i)
+		{
+			while (!queue->push(i))
+			{
+				boost::this_thread::yield();
+			}
+		}
+	}
+
+	void produceLocked(boost::mutex *mutex, std::queue<int> *queue)
+	{
+		for (int i = 0; i < queueItems; ++i)
+		{
+			boost::mutex::scoped_lock lock(*mutex);
+			queue->push(i);
+		}
+	}
+
+	void benchQueue()
+	{
+		const int total = queueProducers * queueItems;
+		Queue<int> queue(8192);
+		boost::mutex mutex;
+		std::queue<int> locked;
+		boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+		for (int i = 0, value = 0; i < total; ++i)
+		{
+			queue.push(i);
+			queue.pop(value);
+			sink += value;
+		}
+		report("queue Queue, one thread", total / 1e6, "M ops/s", getSeconds(start));
+		start = boost::chrono::steady_clock::now();
+		for (int i = 0; i < total; ++i)
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			locked.push(i);
+			sink += locked.front();
+			locked.pop();
+		}
+		report("queue mutex + std::queue, one thread", total / 1e6, "M ops/s", getSeconds(start));
+		boost::thread_group producers;
+		start = boost::chrono::steady_clock::now();
+		for (int i = 0; i < queueProducers; ++i)
+		{
+			producers.create_thread(boost::bind(&produceQueue, &queue));
+		}
+		for (int received = 0, value = 0; received < total;)
+		{
+			if (!queue.pop(value))
+			{
+				boost::this_thread::yield();
+				continue;
+			}
+			sink += value;
+			++received;
+		}
+		producers.join_all();
+		report("queue Queue, 4 producers", total / 1e6, "M ops/s", getSeconds(start));
+		start = boost::chrono::steady_clock::now();
+		for (int i = 0; i < queueProducers; ++i)
+		{
+			producers.create_thread(boost::bind(&produceLocked, &mutex, &locked));
+		}
+		for (int received = 0; received < total;)
+		{
+			{
+				boost::mutex::scoped_lock lock(mutex);
+				while (!locked.empty())
+				{
+					sink += locked.front();
+					locked.pop();
+					++received;
+				}
+			}
+			boost::this_thread::yield();
+		}
+		producers.join_all();
+		report("queue mutex + std::queue, 4 producers", total / 1e6, "M ops/s", getSeconds(start));
+	}
+
+	void benchTokenizer()
+	{
+		typedef Tokenizer::Schema<4> Position;
+		const std::string text = "13\t42\t123456\t-7";
+		Framer::Line line(text.data(), text.data() + text.size());
+		boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+		for (int i = 0; i < lineRounds; ++i)
+		{
+			Tokenizer tokens;
+			int command = 0, handleID = 0, position = 0, extra = 0;
+			if (tokens.parse(line) && tokens.matches<Position>() && tokens.getCommand(command) && tokens.getInteger<Position, 1>(handleID) && tokens.getInteger<Position, 2>(position) && tokens.getInteger<Position, 3>(extra))
+			{
+				sink += command + handleID + position + extra;
+			}
+		}
+		report("parse Tokenizer", lineRounds / 1e6, "M lines/s", getSeconds(start));
+		start = boost::chrono::steady_clock::now();
+		for (int i = 0; i < lineRounds; ++i)
+		{
+			std::vector<std::string> tokens;
+			boost::algorithm::split(tokens, text, boost::algorithm::is_any_of("\t"));
+			try
+			{
+				sink += boost::lexical_cast<int>(tokens[0]) + boost::lexical_cast<int>(tokens[1]) + boost::lexical_cast<int>(tokens[2]) + boost::lexical_cast<int>(tokens[3]);
+			}
+			catch (boost::bad_lexical_cast &)
+			{
+				continue;
+			}
+		}
+		report("parse split + lexical_cast", lineRounds / 1e6, "M lines/s", getSeconds(start));
+	}
+
+	typedef std::size_t (*Command)(int round);
+
+	const std::string fileName = "music/ambient_track_01.mp3";
+
+	std::size_t encodePlay(int round)
+	{
+		return (Encoder(Server::Play) << 17 << round << 0 << 1 << 0).getSize();
+	}
+
+	std::size_t formatPlay(int round)
+	{
+		return boost::str(boost::format("%1%\t%2%\t%3%\t%4%\t%5%\t%6%\n") % Server::Play % 17 % round % 0 % 1 % 0).size();
+	}
+
+	std::size_t encodeSet3DPosition(int round)
+	{
+		return (Encoder(Server::Set3DPosition) << round << 1234.5678f << -42.25f << 10.0f << 50.0f).getSize();
+	}
+
+	std::size_t formatSet3DPosition(int round)
+	{
+		return boost::str(boost::format("%1%\t%2%\t%3%\t%4%\t%5%\t%6%\n") % Server::Set3DPosition % round % 1234.5678f % -42.25f % 10.0f % 50.0f).size();
+	}
+
+	std::size_t encodeSetVolume(int round)
+	{
+		return (Encoder(Server::SetVolume) << round << 75).getSize();
+	}
+
+	std::size_t formatSetVolume(int round)
+	{
+		return boost::str(boost::format("%1%\t%2%\t%3%\n") % Server::SetVolume % round % 75).size();
+	}
+
+	std::size_t encodeTransfer(int round)
+	{
+		return (Encoder(Server::Transfer) << 1 << round << fileName << static_cast<unsigned long>(4194304) << Encoder::Hex(0x9AE0DAAF)).getSize();
+	}
+
+	std::size_t formatTransfer(int round)
+	{
+		return boost::str(boost::format("%d\t%d\t%d\t%s\t%lu\t%X\n") % Server::Transfer % 1 % round % fileName % static_cast<std::size_t>(4194304) % 0x9AE0DAAF).size();
+	}
+
+	void benchCommand(const char *name, Command encoded, Command formatted)
+	{
+		std::string label = std::string("encode ") + name;
+		boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+		for (int i = 0; i < lineRounds; ++i)
+		{
+			sink += encoded(i);
+		}
+		report(label.c_str(), lineRounds / 1e6, "M lines/s", getSeconds(start));
+		label += " boost::format";
+		start = boost::chrono::steady_clock::now();
+		for (int i = 0; i < lineRounds / 10; ++i)
+		{
+			sink += formatted(i);
+		}
+		report(label.c_str(), lineRounds / 10 / 1e6, "M lines/s", getSeconds(start));
+	}
+
+	void benchEncoder()
+	{
+		benchCommand("Play", &encodePlay, &formatPlay);
+		benchCommand("Set3DPosition", &encodeSet3DPosition, &formatSet3DPosition);
+		benchCommand("SetVolume", &encodeSetVolume, &formatSetVolume);
+		benchCommand("Transfer offer", &encodeTransfer, &formatTransfer);
+	}
+}
+
+int main()
+{
+	benchChecksum();
+	benchQueue();
+	benchTokenizer();
+	benchEncoder();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#if defined _MSC_VER
+	#include <boost/detail/interlocked.hpp>
+
+	#include <intrin.h>
+#endif
+
+namespace Atomic
+{
+	inline void barrier()
+	{
+		#if defined _MSC_VER
+			_ReadWriteBarrier();
+		#elif defined __i386__ || defined __x86_64__
+			__asm__ __volatile__("" : : : "memory");
+		#else
+			__sync_synchronize();
+		#endif
+	}
+
+	inline long compareExchange(volatile long *destination, long exchange, long comparand)
+	{
+		#if defined _MSC_VER
+			return BOOST_INTERLOCKED_COMPARE_EXCHANGE(destination, exchange, comparand);
+		#else
+			return __sync_val_compare_and_swap(destination, comparand, exchange);
+		#endif
+	}
+
+	inline long exchange(volatile long *destination, long value)
+	{
+		#if defined _MSC_VER
+			return BOOST_INTERLOCKED_EXCHANGE(destination, value);
+		#else
+			long comparand = *destination;
+			long result = 0;
+			while ((result = __sync_val_compare_and_swap(destination, comparand, value)) != comparand)
+			{
+				comparand = result;
+			}
+			return result;
+		#endif
+	}
+
+	inline long fetchAdd(volatile long *destination, long value)
+	{
+		#if defined _MSC_VER
+			return BOOST_INTERLOCKED_EXCHANGE_ADD(destination, value);
+		#else
+			return __sync_fetch_and_add(destination, value);
+		#endif
+	}
+
+	inline long load(const volatile long *source)
+	{
+		long value = *source;
+		barrier();
+		return value;
+	}
+
+	inline void store(volatile long *destination, long value)
+	{
+		barrier();
+		*destination = value;
+	}
+};
+
+#endif
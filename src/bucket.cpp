@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bucket.h"
+
+#include <boost/chrono/chrono.hpp>
+
+#include <algorithm>
+#include <cstddef>
+
+Bucket::Bucket()
+{
+	capacity = 0.0;
+	rate = 0;
+	tokens = 0.0;
+	updated = boost::chrono::steady_clock::now();
+}
+
+boost::chrono::steady_clock::duration Bucket::getDelay()
+{
+	if (!rate)
+	{
+		return boost::chrono::steady_clock::duration::zero();
+	}
+	refill();
+	double missing = static_cast<double>(getQuantum()) - tokens;
+	if (missing <= 0.0)
+	{
+		return boost::chrono::steady_clock::duration::zero();
+	}
+	return boost::chrono::duration_cast<boost::chrono::steady_clock::duration>(boost::chrono::duration<double>(missing / static_cast<double>(rate)));
+}
+
+std::size_t Bucket::getRate() const
+{
+	return rate;
+}
+
+void Bucket::give(std::size_t bytes)
+{
+	if (rate)
+	{
+		tokens = std::min(tokens + static_cast<double>(bytes), capacity);
+	}
+}
+
+void Bucket::setRate(std::size_t bytesPerSecond)
+{
+	if (bytesPerSecond == rate)
+	{
+		return;
+	}
+	refill();
+	rate = bytesPerSecond;
+	capacity = std::max(static_cast<double>(rate) / 10.0, 1024.0);
+	tokens = std::min(tokens, capacity);
+}
+
+std::size_t Bucket::take(std::size_t bytes)
+{
+	if (!rate)
+	{
+		return bytes;
+	}
+	refill();
+	std::size_t granted = std::min(bytes, getQuantum());
+	if (tokens < static_cast<double>(granted))
+	{
+		return 0;
+	}
+	tokens -= static_cast<double>(granted);
+	return granted;
+}
+
+std::size_t Bucket::getQuantum() const
+{
+	return std::max(static_cast<std::size_t>(capacity / 8.0), static_cast<std::size_t>(128));
+}
+
+void Bucket::refill()
+{
+	boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+	if (rate)
+	{
+		tokens = std::min(tokens + boost::chrono::duration<double>(now - updated).count() * static_cast<double>(rate), capacity);
+	}
+	updated = now;
+}
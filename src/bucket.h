@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BUCKET_H
+#define BUCKET_H
+
+#include <boost/chrono/chrono.hpp>
+
+#include <cstddef>
+
+/*
+ * Token bucket used to shape pack transfers. The bucket refills at the
+ * configured rate (bytes per second, zero for unlimited) and holds at most
+ * a tenth of a second's worth of tokens. take() grants either the whole
+ * slice asked for or nothing, and never more than an eighth of the
+ * capacity, so data goes out in small, evenly spaced writes. Not
+ * thread-safe; each session guards its own bucket with its mutex.
+ */
+
+class Bucket
+{
+public:
+	Bucket();
+
+	boost::chrono::steady_clock::duration getDelay();
+	std::size_t getRate() const;
+	void give(std::size_t bytes);
+	void setRate(std::size_t bytesPerSecond);
+	std::size_t take(std::size_t bytes);
+private:
+	std::size_t getQuantum() const;
+	void refill();
+
+	double capacity;
+	std::size_t rate;
+	double tokens;
+	boost::chrono::steady_clock::time_point updated;
+};
+
+#endif
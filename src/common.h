@@ -19,16 +19,22 @@
 
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 
 #define CLIENT_VERSION "0.5"
 #define SERVER_VERSION "0.5"
 
 #define MAX_BUFFER (512)
+#define MAX_MESSAGES (8192)
+#define MAX_PLAYERS (1000)
 
+class Mapping;
 class Server;
 class Session;
 
 typedef boost::shared_ptr<boost::asio::ip::tcp::acceptor> SharedAcceptor;
+typedef boost::shared_ptr<Mapping> SharedMapping;
 typedef boost::shared_ptr<Session> SharedSession;
+typedef boost::weak_ptr<Mapping> WeakMapping;
 
 #endif
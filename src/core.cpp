@@ -16,36 +16,120 @@
 
 #include "core.h"
 
+#include "atomic.h"
+#include "crc.h"
+#include "encoder.h"
 #include "main.h"
+#include "manifest.h"
+#include "mapping.h"
 #include "session.h"
 
 #include <boost/algorithm/string.hpp>
-#include <boost/crc.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono/chrono.hpp>
 #include <boost/cstdint.hpp>
-#include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <sdk/plugin.h>
 
 #include <SimpleIni/SimpleIni.h>
 
-#include <fstream>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <ctime>
+#include <limits>
+#include <list>
 #include <map>
+#include <queue>
 #include <set>
 #include <string>
+#include <vector>
 
 boost::scoped_ptr<Core> core;
 
-Core::Core()
+Core::Core() : messages(MAX_MESSAGES)
 {
+	for (int i = 0; i < MAX_PLAYERS; ++i)
+	{
+		coalescedRadioStations[i] = -1;
+	}
+	coalescing = 0;
+	lazyTransfer = 0;
+	lazyTransferRate = 16384;
+	loadingPack = 0;
+	manifestBatching = 0;
+	queuePolicy = Block;
+	queueStopped = 0;
+	tickBatching = false;
+	tickMessages = 256;
+	tickMicroseconds = 2000;
+	sessionTransferRate = 0;
+	transferChunk = 65536;
+	transferLimit = 0;
+	transferRate = 0;
+	transferSessions = 0;
+	transferWindow = 1;
 	packAutomated = false;
 	packFiles = 0;
 	packTransferable = false;
 	server.reset(new Server);
 }
 
+Core::~Core()
+{
+	Atomic::store(&queuePolicy, Drop);
+	if (packThread.joinable())
+	{
+		packThread.join();
+	}
+}
+
+Core::Checksum::Checksum()
+{
+	checksum = 0;
+	fileID = 0;
+	modified = 0;
+	valid = false;
+}
+
 bool Core::setPack(const std::string &name, bool transferable, bool automated)
+{
+	if (Atomic::load(&loadingPack))
+	{
+		logprintf("*** Audio_SetPack: Another audio pack is still being loaded");
+		return false;
+	}
+	std::map<int, Data::File> packedFiles;
+	if (!loadPack(name, transferable, packedFiles))
+	{
+		return false;
+	}
+	applyPack(name, transferable, automated, packedFiles);
+	return true;
+}
+
+bool Core::setPackAsync(const std::string &name, bool transferable, bool automated)
+{
+	if (Atomic::compareExchange(&loadingPack, 1, 0))
+	{
+		logprintf("*** Audio_SetPackAsync: Another audio pack is still being loaded");
+		return false;
+	}
+	if (packThread.joinable())
+	{
+		packThread.join();
+	}
+	boost::thread thread(boost::bind(&Core::runPack, this, name, transferable, automated));
+	packThread.swap(thread);
+	return true;
+}
+
+bool Core::loadPack(const std::string &name, bool transferable, std::map<int, Data::File> &packedFiles)
 {
 	CSimpleIniA ini(true, true, true);
 	SI_Error error = ini.LoadFile("audio.ini");
@@ -72,13 +156,13 @@ bool Core::setPack(const std::string &name, bool transferable, bool automated)
 		logprintf("*** Audio_SetPack: Audio pack \"%s\" not found in audio.ini", name.c_str());
 		return false;
 	}
+	Manifest manifest(name);
+	std::vector<Checksum> checksums;
 	const CSimpleIniA::TKeyVal *sectionData;
 	sectionData = ini.GetSection(section);
 	if (sectionData)
 	{
 		std::string buffer;
-		files.clear();
-		packFiles = 0;
 		for (CSimpleIniA::TKeyVal::const_iterator k = sectionData->begin(); k != sectionData->end(); ++k)
 		{
 			bool remote = false;
@@ -97,8 +181,8 @@ bool Core::setPack(const std::string &name, bool transferable, bool automated)
 				logprintf("*** Audio_SetPack: Error mapping \"%s\" (invalid audio ID: \"%s\")", value, item);
 				continue;
 			}
-			std::map<int, Data::File>::iterator f = files.find(fileID);
-			if (f != files.end())
+			std::map<int, Data::File>::iterator f = packedFiles.find(fileID);
+			if (f != packedFiles.end())
 			{
 				logprintf("*** Audio_SetPack: Error mapping \"%s\" (audio ID %s has already been mapped)", value, item);
 				continue;
@@ -132,32 +216,22 @@ bool Core::setPack(const std::string &name, bool transferable, bool automated)
 				}
 				if (transferable)
 				{
-					std::string fileLocation = boost::str(boost::format("audiopacks/%1%/%2%") % name % buffer);
-					std::fstream fileCRC(fileLocation.c_str(), std::ios_base::in | std::ios_base::binary);
-					if (!fileCRC)
+					std::string fileLocation = "audiopacks/" + name + "/" + buffer;
+					struct stat status;
+					if (::stat(fileLocation.c_str(), &status) != 0)
 					{
-						logprintf("*** Audio_SetPack: Error opening \"%s\" for CRC check", fileLocation.c_str());
-						fileCRC.close();
+						logprintf("*** Audio_SetPack: Error opening \"%s\" for file size check", fileLocation.c_str());
 						continue;
 					}
-					boost::crc_32_type digest;
-					char crcBuffer[MAX_BUFFER];
-					while (fileCRC)
+					size = static_cast<std::size_t>(status.st_size);
+					if (!manifest.find(fileLocation, size, status.st_mtime, checksum))
 					{
-						fileCRC.read(crcBuffer, MAX_BUFFER);
-						digest.process_bytes(crcBuffer, static_cast<std::size_t>(fileCRC.gcount()));
+						Checksum pending;
+						pending.fileID = fileID;
+						pending.modified = status.st_mtime;
+						pending.path = fileLocation;
+						checksums.push_back(pending);
 					}
-					fileCRC.close();
-					checksum = digest.checksum();
-					std::fstream fileIn(fileLocation.c_str(), std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
-					if (!fileIn)
-					{
-						logprintf("*** Audio_SetPack: Error opening \"%s\" for file size check", fileLocation.c_str());
-						fileIn.close();
-						continue;
-					}
-					size = static_cast<std::size_t>(fileIn.tellg());
-					fileIn.close();
 				}
 			}
 			Data::File file;
@@ -165,13 +239,63 @@ bool Core::setPack(const std::string &name, bool transferable, bool automated)
 			file.name = buffer;
 			file.remote = remote;
 			file.size = size;
-			files.insert(std::pair<int, Data::File>(fileID, file));
-			packFiles = files.size();
+			packedFiles.insert(std::pair<int, Data::File>(fileID, file));
+		}
+	}
+	if (!checksums.empty())
+	{
+		boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+		boost::uint64_t checksummedBytes = 0;
+		volatile long next = 0;
+		std::size_t threads = std::max<std::size_t>(1, std::min<std::size_t>(boost::thread::hardware_concurrency(), checksums.size()));
+		boost::thread_group workers;
+		for (std::size_t i = 1; i < threads; ++i)
+		{
+			workers.create_thread(boost::bind(&Core::calculateChecksums, this, &checksums, &next));
 		}
+		calculateChecksums(&checksums, &next);
+		workers.join_all();
+		for (std::vector<Checksum>::iterator c = checksums.begin(); c != checksums.end(); ++c)
+		{
+			std::map<int, Data::File>::iterator f = packedFiles.find(c->fileID);
+			if (!c->valid)
+			{
+				logprintf("*** Audio_SetPack: Error opening \"%s\" for CRC check", c->path.c_str());
+				packedFiles.erase(f);
+				continue;
+			}
+			checksummedBytes += f->second.size;
+			f->second.checksum = c->checksum;
+			manifest.insert(c->path, f->second.size, c->modified, c->checksum);
+		}
+		double seconds = boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+		logprintf("*** Audio_SetPack: Checksummed %d file(s) (%.1f MB) in %.0f ms (%s, %d thread(s), %.2f GB/s)", static_cast<int>(checksums.size()), checksummedBytes / 1048576.0, seconds * 1000.0, CRC::getEngineName(), static_cast<int>(threads), seconds > 0.0 ? checksummedBytes / seconds / 1e9 : 0.0);
+	}
+	if (transferable && !manifest.save())
+	{
+		logprintf("*** Audio_SetPack: Error saving audiopacks/manifest.cache");
 	}
+	return true;
+}
+
+void Core::applyPack(const std::string &name, bool transferable, bool automated, std::map<int, Data::File> &packedFiles)
+{
+	boost::unique_lock<boost::shared_mutex> lock(filesMutex);
+	files.swap(packedFiles);
+	packAutomated = automated;
+	packFiles = files.size();
+	packName = name;
+	packTransferable = transferable;
+	lock.unlock();
+	boost::mutex::scoped_lock mappingsLock(mappingsMutex);
+	mappings.clear();
+	mappingsLock.unlock();
 	logprintf("*** Audio_SetPack: Audio pack set to \"%s\" (%s and %s)", name.c_str(), transferable ? "transferable" : "not transferable", automated ? "automated" : "not automated");
-	for (std::set<SharedSession>::iterator c = getServer()->sessions.begin(); c != getServer()->sessions.end(); ++c)
+	std::vector<SharedSession> sessions = getServer()->getSessions();
+	for (std::vector<SharedSession>::iterator c = sessions.begin(); c != sessions.end(); ++c)
 	{
+		boost::mutex::scoped_lock sessionLock((*c)->mutex);
+		(*c)->clearReceivedFiles();
 		if ((*c)->connected)
 		{
 			if ((*c)->transferring)
@@ -180,13 +304,324 @@ bool Core::setPack(const std::string &name, bool transferable, bool automated)
 			}
 			if (automated)
 			{
-				(*c)->sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Connect % name));
+				(*c)->sendAsync(Encoder(Server::Connect) << name);
 				(*c)->startTransfer();
 			}
 		}
 	}
-	packAutomated = automated;
-	packName = name;
-	packTransferable = transferable;
-	return true;
+}
+
+void Core::runPack(const std::string &name, bool transferable, bool automated)
+{
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+	Data::Message message;
+	std::map<int, Data::File> packedFiles;
+	message.array.push_back(Data::OnPackLoaded);
+	if (loadPack(name, transferable, packedFiles))
+	{
+		boost::uint64_t totalBytes = 0;
+		for (std::map<int, Data::File>::iterator f = packedFiles.begin(); f != packedFiles.end(); ++f)
+		{
+			totalBytes += f->second.size;
+		}
+		message.array.push_back(static_cast<int>(packedFiles.size()));
+		message.array.push_back(static_cast<int>(std::min<boost::uint64_t>(totalBytes, std::numeric_limits<int>::max())));
+		applyPack(name, transferable, automated, packedFiles);
+	}
+	else
+	{
+		message.array.push_back(-1);
+		message.array.push_back(0);
+	}
+	message.array.push_back(static_cast<int>(boost::chrono::duration_cast<boost::chrono::milliseconds>(boost::chrono::steady_clock::now() - start).count()));
+	message.buffer.push_back(name);
+	Atomic::store(&loadingPack, 0);
+	pushMessage(message);
+}
+
+void Core::calculateChecksums(std::vector<Checksum> *checksums, volatile long *next)
+{
+	while (true)
+	{
+		std::size_t index = static_cast<std::size_t>(Atomic::fetchAdd(next, 1));
+		if (index >= checksums->size())
+		{
+			break;
+		}
+		Checksum &checksum = checksums->at(index);
+		Mapping mapping;
+		if (mapping.open(checksum.path) && mapping.calculateChecksum(mapping.getSize(), checksum.checksum))
+		{
+			checksum.valid = true;
+		}
+	}
+}
+
+SharedMapping Core::getMapping(const std::string &path)
+{
+	boost::mutex::scoped_lock lock(mappingsMutex);
+	std::map<std::string, WeakMapping>::iterator m = mappings.find(path);
+	if (m != mappings.end())
+	{
+		SharedMapping mapping = m->second.lock();
+		if (mapping)
+		{
+			return mapping;
+		}
+	}
+	for (m = mappings.begin(); m != mappings.end();)
+	{
+		if (m->second.expired())
+		{
+			mappings.erase(m++);
+		}
+		else
+		{
+			++m;
+		}
+	}
+	SharedMapping mapping(new Mapping);
+	if (!mapping->open(path))
+	{
+		return SharedMapping();
+	}
+	mappings.insert(std::make_pair(path, WeakMapping(mapping)));
+	return mapping;
+}
+
+int Core::findCallback(AMX *amx, Data::Interface &interface, int callbackID)
+{
+	if (callbackID < 0 || callbackID >= static_cast<int>(callbackNames.size()))
+	{
+		return -1;
+	}
+	if (callbackID >= static_cast<int>(interface.customCallbacks.size()))
+	{
+		interface.customCallbacks.resize(callbackNames.size(), -2);
+	}
+	if (interface.customCallbacks.at(callbackID) == -2)
+	{
+		int amxIndex = 0;
+		if (amx_FindPublic(amx, callbackNames.at(callbackID).c_str(), &amxIndex))
+		{
+			amxIndex = -1;
+		}
+		interface.customCallbacks.at(callbackID) = amxIndex;
+	}
+	return interface.customCallbacks.at(callbackID);
+}
+
+int Core::internCallback(const std::string &name)
+{
+	boost::unordered_map<std::string, int>::iterator c = callbackIDs.find(name);
+	if (c != callbackIDs.end())
+	{
+		return c->second;
+	}
+	int callbackID = static_cast<int>(callbackNames.size());
+	callbackIDs.insert(std::make_pair(name, callbackID));
+	callbackNames.push_back(name);
+	return callbackID;
+}
+
+void Core::flushCommands()
+{
+	for (std::vector<SharedSession>::iterator s = stagedSessions.begin(); s != stagedSessions.end(); ++s)
+	{
+		boost::mutex::scoped_lock lock((*s)->mutex);
+		(*s)->staged = false;
+		(*s)->flushAsync();
+	}
+	stagedSessions.clear();
+}
+
+void Core::sendCommand(const SharedSession &session, const Encoder &encoder, int handleID)
+{
+	if (handleID && session->deferCommand(handleID, encoder))
+	{
+		return;
+	}
+	if (!tickBatching)
+	{
+		session->sendAsync(encoder);
+		return;
+	}
+	session->stageAsync(encoder);
+	if (!session->staged)
+	{
+		session->staged = true;
+		stagedSessions.push_back(session);
+	}
+}
+
+void Core::erasePlayer(int playerID, const std::string &name)
+{
+	std::pair<boost::unordered_multimap<std::string, int>::iterator, boost::unordered_multimap<std::string, int>::iterator> range = playerNames.equal_range(name);
+	for (boost::unordered_multimap<std::string, int>::iterator p = range.first; p != range.second; ++p)
+	{
+		if (p->second == playerID)
+		{
+			playerNames.erase(p);
+			break;
+		}
+	}
+}
+
+int Core::findPlayer(const std::string &name)
+{
+	int playerID = std::numeric_limits<int>::max();
+	std::pair<boost::unordered_multimap<std::string, int>::iterator, boost::unordered_multimap<std::string, int>::iterator> range = playerNames.equal_range(name);
+	for (boost::unordered_multimap<std::string, int>::iterator p = range.first; p != range.second; ++p)
+	{
+		playerID = std::min(playerID, p->second);
+	}
+	return playerID;
+}
+
+void Core::insertPlayer(int playerID, const std::string &name)
+{
+	playerNames.insert(std::make_pair(name, playerID));
+}
+
+bool Core::acquireTransfer(const SharedSession &session)
+{
+	boost::mutex::scoped_lock lock(transfersMutex);
+	if (activeTransfers.find(session) != activeTransfers.end())
+	{
+		return true;
+	}
+	if (std::find(queuedTransfers.begin(), queuedTransfers.end(), session) != queuedTransfers.end())
+	{
+		return false;
+	}
+	if (!transferLimit || activeTransfers.size() < static_cast<std::size_t>(transferLimit))
+	{
+		activeTransfers.insert(session);
+		return true;
+	}
+	queuedTransfers.push_back(session);
+	return false;
+}
+
+int Core::getTransferPosition(const SharedSession &session)
+{
+	boost::mutex::scoped_lock lock(transfersMutex);
+	int position = 1;
+	for (std::list<SharedSession>::iterator t = queuedTransfers.begin(); t != queuedTransfers.end(); ++t)
+	{
+		if (*t == session)
+		{
+			return position;
+		}
+		++position;
+	}
+	return 0;
+}
+
+bool Core::hasTransfer(const SharedSession &session)
+{
+	boost::mutex::scoped_lock lock(transfersMutex);
+	return activeTransfers.find(session) != activeTransfers.end();
+}
+
+void Core::releaseTransfer(const SharedSession &session)
+{
+	boost::mutex::scoped_lock lock(transfersMutex);
+	if (!activeTransfers.erase(session))
+	{
+		queuedTransfers.remove(session);
+		return;
+	}
+	promoteTransfers(lock);
+}
+
+void Core::setTransferLimit(int limit)
+{
+	boost::mutex::scoped_lock lock(transfersMutex);
+	transferLimit = limit;
+	promoteTransfers(lock);
+}
+
+void Core::promoteTransfers(boost::mutex::scoped_lock &lock)
+{
+	std::vector<SharedSession> promotedTransfers;
+	while (!queuedTransfers.empty() && (!transferLimit || activeTransfers.size() < static_cast<std::size_t>(transferLimit)))
+	{
+		activeTransfers.insert(queuedTransfers.front());
+		promotedTransfers.push_back(queuedTransfers.front());
+		queuedTransfers.pop_front();
+	}
+	lock.unlock();
+	for (std::vector<SharedSession>::iterator t = promotedTransfers.begin(); t != promotedTransfers.end(); ++t)
+	{
+		(*t)->beginTransferAsync();
+	}
+}
+
+bool Core::popMessage(Data::Message &message)
+{
+	if (messages.pop(message))
+	{
+		return true;
+	}
+	if (Atomic::exchange(&coalescing, 0))
+	{
+		for (int i = 0; i < MAX_PLAYERS; ++i)
+		{
+			long radioStation = Atomic::exchange(&coalescedRadioStations[i], -1);
+			if (radioStation != -1)
+			{
+				Data::Message coalescedMessage;
+				coalescedMessage.array.push_back(Data::OnRadioStationChange);
+				coalescedMessage.array.push_back(static_cast<int>(radioStation));
+				coalescedMessage.array.push_back(i);
+				coalescedMessages.push(coalescedMessage);
+			}
+		}
+	}
+	if (!coalescedMessages.empty())
+	{
+		message.swap(coalescedMessages.front());
+		coalescedMessages.pop();
+		return true;
+	}
+	return false;
+}
+
+void Core::pushMessage(const Data::Message &message)
+{
+	if (messages.push(message))
+	{
+		return;
+	}
+	switch (Atomic::load(&queuePolicy))
+	{
+		case Drop:
+		{
+			return;
+		}
+		case Coalesce:
+		{
+			if (message.array.at(0) == Data::OnRadioStationChange)
+			{
+				int playerID = message.array.at(2);
+				if (playerID >= 0 && playerID < MAX_PLAYERS)
+				{
+					Atomic::exchange(&coalescedRadioStations[playerID], message.array.at(1));
+					Atomic::store(&coalescing, 1);
+					return;
+				}
+			}
+			// Only radio station changes can be merged; everything else blocks
+			break;
+		}
+	}
+	while (!messages.push(message))
+	{
+		if (Atomic::load(&queueStopped))
+		{
+			return;
+		}
+		boost::this_thread::yield();
+	}
 }
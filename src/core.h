@@ -17,45 +17,149 @@
 #ifndef CORE_H
 #define CORE_H
 
+#include "common.h"
 #include "data.h"
+#include "encoder.h"
+#include "queue.h"
 #include "server.h"
 
+#include <boost/cstdint.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <sdk/plugin.h>
 
+#include <ctime>
+#include <list>
 #include <map>
 #include <queue>
 #include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Lock order: Session::mutex, then Server::mutex, then any one of the
+ * Core mutexes below. The Core mutexes are never held together.
+ * filesMutex also guards the pack* members and playersMutex the player
+ * name index.
+ */
 
 class Core
 {
 public:
 	Core();
+	~Core();
 
 	bool setPack(const std::string &name, bool transferable, bool automated);
+	bool setPackAsync(const std::string &name, bool transferable, bool automated);
+
+	SharedMapping getMapping(const std::string &path);
+
+	int findCallback(AMX *amx, Data::Interface &interface, int callbackID);
+	int internCallback(const std::string &name);
+
+	void flushCommands();
+	void sendCommand(const SharedSession &session, const Encoder &encoder, int handleID = 0);
+
+	void erasePlayer(int playerID, const std::string &name);
+	int findPlayer(const std::string &name);
+	void insertPlayer(int playerID, const std::string &name);
+
+	bool acquireTransfer(const SharedSession &session);
+	int getTransferPosition(const SharedSession &session);
+	bool hasTransfer(const SharedSession &session);
+	void releaseTransfer(const SharedSession &session);
+	void setTransferLimit(int limit);
+
+	bool popMessage(Data::Message &message);
+	void pushMessage(const Data::Message &message);
+
+	enum QueuePolicies
+	{
+		Drop,
+		Coalesce,
+		Block
+	};
 
 	inline Server *getServer()
 	{
 		return server.get();
 	}
 
-	boost::mutex mutex;
+	boost::shared_mutex filesMutex;
+	boost::mutex playersMutex;
+	boost::mutex sequencesMutex;
 
 	bool packAutomated;
 	int packFiles;
 	std::string packName;
 	bool packTransferable;
 
-	std::set<AMX*> interfaces;
-	std::queue<Data::Message> messages;
+	std::map<AMX*, Data::Interface> interfaces;
+	// Plays of missing files jump the queue; other files trickle at lazyTransferRate
+	// unless a play or prioritized file is waiting behind them
+	volatile long lazyTransfer;
+	volatile long lazyTransferRate;
+	// Passes open with the whole manifest; unrequested files count as checked
+	volatile long manifestBatching;
+	volatile long queuePolicy;
+	// Set while the server stops so producers waiting on a full queue drop instead
+	volatile long queueStopped;
+	// Lifted, with the trickle, while commands wait behind a download
+	volatile long sessionTransferRate;
+	// Commands from natives are staged and flushed at the end of ProcessTick
+	bool tickBatching;
+	int tickMessages;
+	int tickMicroseconds;
+	volatile long transferChunk;
+	// Split evenly between the transferSessions currently downloading
+	volatile long transferRate;
+	volatile long transferSessions;
+	// Offers sent before the client answers the first of them
+	volatile long transferWindow;
 
 	std::map<int, Data::File> files;
 	std::map<int, Data::Sequence> sequences;
 	std::map<int, Data::Player> players;
 private:
+	struct Checksum
+	{
+		Checksum();
+
+		boost::uint32_t checksum;
+		int fileID;
+		std::time_t modified;
+		std::string path;
+		bool valid;
+	};
+
+	void applyPack(const std::string &name, bool transferable, bool automated, std::map<int, Data::File> &packedFiles);
+	void calculateChecksums(std::vector<Checksum> *checksums, volatile long *next);
+	bool loadPack(const std::string &name, bool transferable, std::map<int, Data::File> &packedFiles);
+	void promoteTransfers(boost::mutex::scoped_lock &lock);
+	void runPack(const std::string &name, bool transferable, bool automated);
+
+	std::set<SharedSession> activeTransfers;
+	boost::unordered_map<std::string, int> callbackIDs;
+	std::vector<std::string> callbackNames;
+	std::queue<Data::Message> coalescedMessages;
+	volatile long coalescedRadioStations[MAX_PLAYERS];
+	volatile long coalescing;
+	volatile long loadingPack;
+	// Shared by path while some transfer holds the file; closed with its last user
+	std::map<std::string, WeakMapping> mappings;
+	boost::mutex mappingsMutex;
+	// Published without a lock and only popped by ProcessTick
+	Queue<Data::Message> messages;
+	boost::thread packThread;
+	boost::unordered_multimap<std::string, int> playerNames;
+	std::list<SharedSession> queuedTransfers;
+	std::vector<SharedSession> stagedSessions;
 	boost::scoped_ptr<Server> server;
+	// Sessions holding a transfer slot (zero for no limit); the rest wait in queuedTransfers
+	int transferLimit;
+	boost::mutex transfersMutex;
 };
 
 extern boost::scoped_ptr<Core> core;
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "crc.h"
+
+#include <boost/cstdint.hpp>
+#include <boost/detail/endian.hpp>
+
+#if defined __i386__ || defined __x86_64__ || defined _M_IX86 || defined _M_X64
+	#define CRC_FOLDING
+
+	#if defined _MSC_VER
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+
+	#include <emmintrin.h>
+	#include <wmmintrin.h>
+
+	#if defined __GNUC__
+		#define CRC_TARGET __attribute__((target("sse2,pclmul")))
+	#else
+		#define CRC_TARGET
+	#endif
+#endif
+
+#include <cstddef>
+#include <cstring>
+
+namespace CRC
+{
+	struct Tables
+	{
+		Tables();
+
+		Engine engine;
+		const char *engineName;
+		boost::uint32_t slices[16][256];
+	};
+
+	Tables tables;
+};
+
+CRC::Tables::Tables()
+{
+	for (boost::uint32_t i = 0; i < 256; ++i)
+	{
+		boost::uint32_t value = i;
+		for (int j = 0; j < 8; ++j)
+		{
+			value = (value >> 1) ^ (0xEDB88320 & (0 - (value & 1)));
+		}
+		slices[0][i] = value;
+	}
+	for (boost::uint32_t i = 0; i < 256; ++i)
+	{
+		for (int j = 1; j < 16; ++j)
+		{
+			slices[j][i] = (slices[j - 1][i] >> 8) ^ slices[0][slices[j - 1][i] & 0xFF];
+		}
+	}
+	#if defined BOOST_LITTLE_ENDIAN
+		engine = &updateSliced;
+		engineName = "slice-by-16";
+	#else
+		engine = &updateBytewise;
+		engineName = "bytewise";
+	#endif
+	#if defined CRC_FOLDING
+		unsigned int registers[4] = { 0 };
+		#if defined _MSC_VER
+			__cpuid(reinterpret_cast<int*>(registers), 1);
+		#else
+			__get_cpuid(1, &registers[0], &registers[1], &registers[2], &registers[3]);
+		#endif
+		if ((registers[2] & (1 << 1)) && (registers[3] & (1 << 26)))
+		{
+			engine = &updateFolded;
+			engineName = "PCLMULQDQ";
+		}
+	#endif
+}
+
+boost::uint32_t CRC::calculate(const char *data, std::size_t length, boost::uint32_t checksum)
+{
+	return ~tables.engine(~checksum, reinterpret_cast<const unsigned char*>(data), length);
+}
+
+const char *CRC::getEngineName()
+{
+	return tables.engineName;
+}
+
+boost::uint32_t CRC::updateBytewise(boost::uint32_t state, const unsigned char *data, std::size_t length)
+{
+	while (length--)
+	{
+		state = (state >> 8) ^ tables.slices[0][(state ^ *data++) & 0xFF];
+	}
+	return state;
+}
+
+boost::uint32_t CRC::updateSliced(boost::uint32_t state, const unsigned char *data, std::size_t length)
+{
+	#if defined BOOST_LITTLE_ENDIAN
+		while (length >= 16)
+		{
+			boost::uint32_t words[4];
+			std::memcpy(words, data, sizeof(words));
+			words[0] ^= state;
+			state = tables.slices[15][words[0] & 0xFF] ^ tables.slices[14][(words[0] >> 8) & 0xFF] ^ tables.slices[13][(words[0] >> 16) & 0xFF] ^ tables.slices[12][words[0] >> 24]
+				^ tables.slices[11][words[1] & 0xFF] ^ tables.slices[10][(words[1] >> 8) & 0xFF] ^ tables.slices[9][(words[1] >> 16) & 0xFF] ^ tables.slices[8][words[1] >> 24]
+				^ tables.slices[7][words[2] & 0xFF] ^ tables.slices[6][(words[2] >> 8) & 0xFF] ^ tables.slices[5][(words[2] >> 16) & 0xFF] ^ tables.slices[4][words[2] >> 24]
+				^ tables.slices[3][words[3] & 0xFF] ^ tables.slices[2][(words[3] >> 8) & 0xFF] ^ tables.slices[1][(words[3] >> 16) & 0xFF] ^ tables.slices[0][words[3] >> 24];
+			data += 16;
+			length -= 16;
+		}
+	#endif
+	return updateBytewise(state, data, length);
+}
+
+#if defined CRC_FOLDING
+
+/*
+ * Folds 64 bytes at a time with carry-less multiplication and reduces the
+ * remainder with a Barrett reduction, as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ */
+
+CRC_TARGET boost::uint32_t CRC::updateFolded(boost::uint32_t state, const unsigned char *data, std::size_t length)
+{
+	static const boost::uint64_t k1k2[2] = { 0x0154442BD4ULL, 0x01C6E41596ULL };
+	static const boost::uint64_t k3k4[2] = { 0x01751997D0ULL, 0x00CCAA009EULL };
+	static const boost::uint64_t k5k0[2] = { 0x0163CD6124ULL, 0x0000000000ULL };
+	static const boost::uint64_t poly[2] = { 0x01DB710641ULL, 0x01F7011641ULL };
+	if (length < 64)
+	{
+		return updateSliced(state, data, length);
+	}
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+	x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+	x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+	x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+	x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(state)));
+	x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(k1k2));
+	data += 64;
+	length -= 64;
+	while (length >= 64)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30)));
+		data += 64;
+		length -= 64;
+	}
+	x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(k3k4));
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+	while (length >= 16)
+	{
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data))), x5);
+		data += 16;
+		length -= 16;
+	}
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(poly));
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	state = static_cast<boost::uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(x1, 4)));
+	return updateSliced(state, data, length);
+}
+
+#else
+
+boost::uint32_t CRC::updateFolded(boost::uint32_t state, const unsigned char *data, std::size_t length)
+{
+	return updateSliced(state, data, length);
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <boost/cstdint.hpp>
+
+#include <cstddef>
+
+/*
+ * CRC-32 (IEEE 802.3, as produced by boost::crc_32_type) with the fastest
+ * engine the processor supports: PCLMULQDQ folding on x86, slice-by-16
+ * tables on other little-endian targets and a byte table otherwise.
+ */
+
+namespace CRC
+{
+	typedef boost::uint32_t (*Engine)(boost::uint32_t state, const unsigned char *data, std::size_t length);
+
+	boost::uint32_t calculate(const char *data, std::size_t length, boost::uint32_t checksum = 0);
+	const char *getEngineName();
+
+	boost::uint32_t updateBytewise(boost::uint32_t state, const unsigned char *data, std::size_t length);
+	boost::uint32_t updateFolded(boost::uint32_t state, const unsigned char *data, std::size_t length);
+	boost::uint32_t updateSliced(boost::uint32_t state, const unsigned char *data, std::size_t length);
+};
+
+#endif
@@ -24,3 +24,22 @@ Data::File::File()
 	remote = false;
 	size = 0;
 }
+
+Data::Interface::Interface()
+{
+	for (int i = 0; i < OnGetPosition; ++i)
+	{
+		callbacks[i] = -1;
+	}
+}
+
+void Data::Message::swap(Message &message)
+{
+	array.swap(message.array);
+	buffer.swap(message.buffer);
+}
+
+void Data::swap(Message &first, Message &second)
+{
+	first.swap(second);
+}
@@ -17,10 +17,12 @@
 #ifndef DATA_H
 #define DATA_H
 
+#include "common.h"
+
 #include <boost/cstdint.hpp>
 
+#include <bitset>
 #include <map>
-#include <set>
 #include <string>
 #include <vector>
 
@@ -35,6 +37,7 @@ namespace Data
 		OnStop,
 		OnRadioStationChange,
 		OnTrackChange,
+		OnPackLoaded,
 		OnGetPosition
 	};
 
@@ -42,15 +45,30 @@ namespace Data
 	{
 		File();
 
+		inline bool hasPlayer(int playerID) const
+		{
+			return playerID >= 0 && playerID < MAX_PLAYERS && players.test(static_cast<std::size_t>(playerID));
+		}
+
 		boost::uint32_t checksum;
 		std::string name;
-		std::set<int> players;
+		std::bitset<MAX_PLAYERS> players;
 		bool remote;
 		std::size_t size;
 	};
 
+	struct Interface
+	{
+		Interface();
+
+		int callbacks[OnGetPosition];
+		std::vector<int> customCallbacks;
+	};
+
 	struct Message
 	{
+		void swap(Message &message);
+
 		std::vector<int> array;
 		std::vector<std::string> buffer;
 	};
@@ -66,6 +84,8 @@ namespace Data
 		std::string address;
 		std::vector<std::string> name;
 	};
+
+	void swap(Message &first, Message &second);
 };
 
 #endif
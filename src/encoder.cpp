@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "encoder.h"
+
+#include <boost/cstdint.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+Encoder::Encoder(int command)
+{
+	length = 0;
+	storage[0] = '\n';
+	*this << command;
+}
+
+Encoder &Encoder::operator<<(int value)
+{
+	char digits[16];
+	char *end = digits + sizeof(digits), *begin = end;
+	unsigned long magnitude = value < 0 ? 0 - static_cast<unsigned long>(value) : static_cast<unsigned long>(value);
+	do
+	{
+		*--begin = static_cast<char>('0' + magnitude % 10);
+		magnitude /= 10;
+	}
+	while (magnitude);
+	if (value < 0)
+	{
+		*--begin = '-';
+	}
+	append(begin, static_cast<std::size_t>(end - begin));
+	return *this;
+}
+
+Encoder &Encoder::operator<<(unsigned long value)
+{
+	char digits[24];
+	char *end = digits + sizeof(digits), *begin = end;
+	do
+	{
+		*--begin = static_cast<char>('0' + value % 10);
+		value /= 10;
+	}
+	while (value);
+	append(begin, static_cast<std::size_t>(end - begin));
+	return *this;
+}
+
+Encoder &Encoder::operator<<(float value)
+{
+	char digits[32];
+	char *end = digits + sizeof(digits), *begin = end;
+	double magnitude = value < 0.0f ? -static_cast<double>(value) : static_cast<double>(value);
+	if (!(magnitude <= 1e14))
+	{
+		magnitude = magnitude == magnitude ? 1e14 : 0.0;
+	}
+	boost::uint64_t scaled = static_cast<boost::uint64_t>(magnitude * 10000.0 + 0.5);
+	boost::uint64_t integral = scaled / 10000;
+	unsigned int fraction = static_cast<unsigned int>(scaled % 10000);
+	if (fraction)
+	{
+		int places = 4;
+		while (!(fraction % 10))
+		{
+			fraction /= 10;
+			--places;
+		}
+		while (places--)
+		{
+			*--begin = static_cast<char>('0' + fraction % 10);
+			fraction /= 10;
+		}
+		*--begin = '.';
+	}
+	do
+	{
+		*--begin = static_cast<char>('0' + integral % 10);
+		integral /= 10;
+	}
+	while (integral);
+	if (value < 0.0f && scaled)
+	{
+		*--begin = '-';
+	}
+	append(begin, static_cast<std::size_t>(end - begin));
+	return *this;
+}
+
+Encoder &Encoder::operator<<(const Hex &value)
+{
+	static const char hexadecimal[] = "0123456789ABCDEF";
+	char digits[8];
+	char *end = digits + sizeof(digits), *begin = end;
+	boost::uint32_t remaining = value.value;
+	do
+	{
+		*--begin = hexadecimal[remaining & 0xF];
+		remaining >>= 4;
+	}
+	while (remaining);
+	append(begin, static_cast<std::size_t>(end - begin));
+	return *this;
+}
+
+Encoder &Encoder::operator<<(const char *value)
+{
+	append(value, std::strlen(value));
+	return *this;
+}
+
+Encoder &Encoder::operator<<(const std::string &value)
+{
+	append(value.data(), value.length());
+	return *this;
+}
+
+void Encoder::append(const char *data, std::size_t size)
+{
+	char *output = reserve(size + 1);
+	if (length)
+	{
+		*output++ = '\t';
+		++length;
+	}
+	std::memcpy(output, data, size);
+	length += size;
+	output[size] = '\n';
+}
+
+char *Encoder::reserve(std::size_t size)
+{
+	std::size_t required = length + size + 1;
+	if (heap.empty())
+	{
+		if (required <= storage.size())
+		{
+			return storage.data() + length;
+		}
+		heap.assign(storage.begin(), storage.begin() + length + 1);
+	}
+	if (required > heap.size())
+	{
+		heap.resize(std::max(required, heap.size() * 2));
+	}
+	return &heap[length];
+}
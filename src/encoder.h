@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "common.h"
+
+#include <boost/array.hpp>
+#include <boost/cstdint.hpp>
+
+#include <string>
+#include <vector>
+
+/*
+ * Builds one tab-separated, newline-terminated command line without
+ * boost::format, streams or locales. Short lines stay in the inline
+ * buffer; longer ones spill over to the heap.
+ */
+
+class Encoder
+{
+public:
+	struct Hex
+	{
+		explicit Hex(boost::uint32_t value) : value(value) {}
+
+		boost::uint32_t value;
+	};
+
+	Encoder(int command);
+
+	Encoder &operator<<(int value);
+	Encoder &operator<<(unsigned long value);
+	Encoder &operator<<(float value);
+	Encoder &operator<<(const Hex &value);
+	Encoder &operator<<(const char *value);
+	Encoder &operator<<(const std::string &value);
+
+	inline const char *getData() const
+	{
+		return heap.empty() ? storage.data() : &heap.front();
+	}
+
+	inline std::size_t getSize() const
+	{
+		return length + 1;
+	}
+private:
+	void append(const char *data, std::size_t size);
+	char *reserve(std::size_t size);
+
+	boost::array<char, MAX_BUFFER> storage;
+	std::vector<char> heap;
+	std::size_t length;
+};
+
+#endif
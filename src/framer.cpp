@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "framer.h"
+
+#include <boost/asio.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+Framer::Framer(std::size_t capacity, std::size_t limit) : buffer(capacity), limit(limit)
+{
+	discarding = false;
+	end = 0;
+	position = 0;
+	scanned = 0;
+}
+
+void Framer::commit(std::size_t length)
+{
+	end += length;
+}
+
+bool Framer::next(Line &line)
+{
+	while (scanned < end)
+	{
+		const char *begin = &buffer[0];
+		const char *delimiter = static_cast<const char*>(std::memchr(begin + scanned, '\n', end - scanned));
+		if (!delimiter)
+		{
+			scanned = end;
+			break;
+		}
+		std::size_t start = position;
+		position = scanned = static_cast<std::size_t>(delimiter - begin) + 1;
+		if (discarding)
+		{
+			discarding = false;
+			continue;
+		}
+		line = Line(begin + start, delimiter);
+		return true;
+	}
+	return false;
+}
+
+boost::asio::mutable_buffers_1 Framer::prepare()
+{
+	if (position)
+	{
+		std::memmove(&buffer[0], &buffer[position], end - position);
+		end -= position;
+		scanned -= position;
+		position = 0;
+	}
+	if (end == buffer.size())
+	{
+		if (buffer.size() < limit)
+		{
+			buffer.resize(std::min(buffer.size() * 2, limit));
+		}
+		else
+		{
+			discarding = true;
+			end = 0;
+			scanned = 0;
+		}
+	}
+	return boost::asio::buffer(&buffer[end], buffer.size() - end);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include <boost/asio.hpp>
+#include <boost/range/iterator_range.hpp>
+
+#include <vector>
+
+/*
+ * Splits a byte stream into newline-terminated lines. Received data is
+ * appended in place and partial lines are kept until the rest arrives.
+ * Lines point into the buffer and stay valid until the next prepare().
+ */
+
+class Framer
+{
+public:
+	typedef boost::iterator_range<const char*> Line;
+
+	Framer(std::size_t capacity, std::size_t limit);
+
+	void commit(std::size_t length);
+	bool next(Line &line);
+	boost::asio::mutable_buffers_1 prepare();
+private:
+	std::vector<char> buffer;
+	bool discarding;
+	std::size_t end;
+	std::size_t limit;
+	std::size_t position;
+	std::size_t scanned;
+};
+
+#endif
@@ -19,9 +19,11 @@
 #include "core.h"
 #include "natives.h"
 
+#include <boost/chrono/chrono.hpp>
+
 #include <sdk/plugin.h>
 
-#include <set>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -43,6 +45,10 @@ PLUGIN_EXPORT bool PLUGIN_CALL Load(void **ppData)
 
 PLUGIN_EXPORT void PLUGIN_CALL Unload()
 {
+	if (core->getServer()->isRunning())
+	{
+		core->getServer()->stopAsync();
+	}
 	core.reset();
 	logprintf("\n\n*** Audio Plugin v%s by Incognito unloaded ***\n", PLUGIN_VERSION);
 }
@@ -52,9 +58,23 @@ AMX_NATIVE_INFO natives[] =
 	{ "Audio_CreateTCPServer", Natives::Audio_CreateTCPServer },
 	{ "Audio_DestroyTCPServer", Natives::Audio_DestroyTCPServer },
 	{ "Audio_SetPack", Natives::Audio_SetPack },
+	{ "Audio_SetPackAsync", Natives::Audio_SetPackAsync },
 	{ "Audio_IsClientConnected", Natives::Audio_IsClientConnected },
 	{ "Audio_SendMessage", Natives::Audio_SendMessage },
 	{ "Audio_TransferPack", Natives::Audio_TransferPack },
+	{ "Audio_PrioritizeFile", Natives::Audio_PrioritizeFile },
+	{ "Audio_SetQueuePolicy", Natives::Audio_SetQueuePolicy },
+	{ "Audio_GetTickBudget", Natives::Audio_GetTickBudget },
+	{ "Audio_SetTickBudget", Natives::Audio_SetTickBudget },
+	{ "Audio_SetTickBatching", Natives::Audio_SetTickBatching },
+	{ "Audio_SetManifestBatching", Natives::Audio_SetManifestBatching },
+	{ "Audio_SetLazyTransfer", Natives::Audio_SetLazyTransfer },
+	{ "Audio_SetTransferChunkSize", Natives::Audio_SetTransferChunkSize },
+	{ "Audio_SetTransferRate", Natives::Audio_SetTransferRate },
+	{ "Audio_SetTransferLimit", Natives::Audio_SetTransferLimit },
+	{ "Audio_SetTransferWindow", Natives::Audio_SetTransferWindow },
+	{ "Audio_GetTransferPosition", Natives::Audio_GetTransferPosition },
+	{ "Audio_GetTransferStats", Natives::Audio_GetTransferStats },
 	{ "Audio_CreateSequence", Natives::Audio_CreateSequence },
 	{ "Audio_DestroySequence", Natives::Audio_DestroySequence },
 	{ "Audio_AddToSequence", Natives::Audio_AddToSequence },
@@ -81,9 +101,29 @@ AMX_NATIVE_INFO natives[] =
 	{ 0, 0 }
 };
 
+const char *callbacks[] =
+{
+	"Audio_OnClientConnect",
+	"Audio_OnClientDisconnect",
+	"Audio_OnTransferFile",
+	"Audio_OnPlay",
+	"Audio_OnStop",
+	"Audio_OnRadioStationChange",
+	"Audio_OnTrackChange",
+	"Audio_OnPackLoaded"
+};
+
 PLUGIN_EXPORT int PLUGIN_CALL AmxLoad(AMX *amx)
 {
-	core->interfaces.insert(amx);
+	Data::Interface interface;
+	for (int i = 0; i < Data::OnGetPosition; ++i)
+	{
+		if (amx_FindPublic(amx, callbacks[i], &interface.callbacks[i]))
+		{
+			interface.callbacks[i] = -1;
+		}
+	}
+	core->interfaces[amx] = interface;
 	return amx_Register(amx, natives, -1);
 }
 
@@ -95,13 +135,12 @@ PLUGIN_EXPORT int PLUGIN_CALL AmxUnload(AMX *amx)
 
 PLUGIN_EXPORT void PLUGIN_CALL ProcessTick()
 {
-	if (!core->messages.empty())
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+	Data::Message message;
+	int processedMessages = 0;
+	while (core->popMessage(message))
 	{
-		boost::mutex::scoped_lock lock(core->mutex);
-		Data::Message message(core->messages.front());
-		core->messages.pop();
-		lock.unlock();
-		for (std::set<AMX*>::iterator i = core->interfaces.begin(); i != core->interfaces.end(); ++i)
+		for (std::map<AMX*, Data::Interface>::iterator i = core->interfaces.begin(); i != core->interfaces.end(); ++i)
 		{
 			cell amxAddress = 0;
 			int amxIndex = 0;
@@ -109,90 +148,121 @@ PLUGIN_EXPORT void PLUGIN_CALL ProcessTick()
 			{
 				case Data::OnClientConnect:
 				{
-					if (!amx_FindPublic(*i, "Audio_OnClientConnect", &amxIndex))
+					amxIndex = i->second.callbacks[Data::OnClientConnect];
+					if (amxIndex >= 0)
 					{
-						amx_Push(*i, message.array.at(1));
-						amx_Exec(*i, NULL, amxIndex);
+						amx_Push(i->first, message.array.at(1));
+						amx_Exec(i->first, NULL, amxIndex);
 					}
 					break;
 				}
 				case Data::OnClientDisconnect:
 				{
-					if (!amx_FindPublic(*i, "Audio_OnClientDisconnect", &amxIndex))
+					amxIndex = i->second.callbacks[Data::OnClientDisconnect];
+					if (amxIndex >= 0)
 					{
-						amx_Push(*i, message.array.at(1));
-						amx_Exec(*i, NULL, amxIndex);
+						amx_Push(i->first, message.array.at(1));
+						amx_Exec(i->first, NULL, amxIndex);
 					}
 					break;
 				}
 				case Data::OnTransferFile:
 				{
-					if (!amx_FindPublic(*i, "Audio_OnTransferFile", &amxIndex))
+					amxIndex = i->second.callbacks[Data::OnTransferFile];
+					if (amxIndex >= 0)
 					{
-						amx_Push(*i, message.array.at(1));
-						amx_Push(*i, message.array.at(2));
-						amx_Push(*i, message.array.at(3));
-						amx_PushString(*i, &amxAddress, NULL, message.buffer.at(0).c_str(), 0, 0);
-						amx_Push(*i, message.array.at(4));
-						amx_Exec(*i, NULL, amxIndex);
-						amx_Release(*i, amxAddress);
+						amx_Push(i->first, message.array.at(1));
+						amx_Push(i->first, message.array.at(2));
+						amx_Push(i->first, message.array.at(3));
+						amx_PushString(i->first, &amxAddress, NULL, message.buffer.at(0).c_str(), 0, 0);
+						amx_Push(i->first, message.array.at(4));
+						amx_Exec(i->first, NULL, amxIndex);
+						amx_Release(i->first, amxAddress);
 					}
 					break;
 				}
 				case Data::OnPlay:
 				{
-					if (!amx_FindPublic(*i, "Audio_OnPlay", &amxIndex))
+					amxIndex = i->second.callbacks[Data::OnPlay];
+					if (amxIndex >= 0)
 					{
-						amx_Push(*i, message.array.at(1));
-						amx_Push(*i, message.array.at(2));
-						amx_Exec(*i, NULL, amxIndex);
+						amx_Push(i->first, message.array.at(1));
+						amx_Push(i->first, message.array.at(2));
+						amx_Exec(i->first, NULL, amxIndex);
 					}
 					break;
 				}
 				case Data::OnStop:
 				{
-					if (!amx_FindPublic(*i, "Audio_OnStop", &amxIndex))
+					amxIndex = i->second.callbacks[Data::OnStop];
+					if (amxIndex >= 0)
 					{
-						amx_Push(*i, message.array.at(1));
-						amx_Push(*i, message.array.at(2));
-						amx_Exec(*i, NULL, amxIndex);
+						amx_Push(i->first, message.array.at(1));
+						amx_Push(i->first, message.array.at(2));
+						amx_Exec(i->first, NULL, amxIndex);
 					}
 					break;
 				}
 				case Data::OnRadioStationChange:
 				{
-					if (!amx_FindPublic(*i, "Audio_OnRadioStationChange", &amxIndex))
+					amxIndex = i->second.callbacks[Data::OnRadioStationChange];
+					if (amxIndex >= 0)
 					{
-						amx_Push(*i, message.array.at(1));
-						amx_Push(*i, message.array.at(2));
-						amx_Exec(*i, NULL, amxIndex);
+						amx_Push(i->first, message.array.at(1));
+						amx_Push(i->first, message.array.at(2));
+						amx_Exec(i->first, NULL, amxIndex);
 					}
 					break;
 				}
 				case Data::OnTrackChange:
 				{
-					if (!amx_FindPublic(*i, "Audio_OnTrackChange", &amxIndex))
+					amxIndex = i->second.callbacks[Data::OnTrackChange];
+					if (amxIndex >= 0)
 					{
-						amx_PushString(*i, &amxAddress, NULL, message.buffer.at(0).c_str(), 0, 0);
-						amx_Push(*i, message.array.at(1));
-						amx_Push(*i, message.array.at(2));
-						amx_Exec(*i, NULL, amxIndex);
-						amx_Release(*i, amxAddress);
+						amx_PushString(i->first, &amxAddress, NULL, message.buffer.at(0).c_str(), 0, 0);
+						amx_Push(i->first, message.array.at(1));
+						amx_Push(i->first, message.array.at(2));
+						amx_Exec(i->first, NULL, amxIndex);
+						amx_Release(i->first, amxAddress);
+					}
+					break;
+				}
+				case Data::OnPackLoaded:
+				{
+					amxIndex = i->second.callbacks[Data::OnPackLoaded];
+					if (amxIndex >= 0)
+					{
+						amx_Push(i->first, message.array.at(3));
+						amx_Push(i->first, message.array.at(2));
+						amx_Push(i->first, message.array.at(1));
+						amx_PushString(i->first, &amxAddress, NULL, message.buffer.at(0).c_str(), 0, 0);
+						amx_Exec(i->first, NULL, amxIndex);
+						amx_Release(i->first, amxAddress);
 					}
 					break;
 				}
 				case Data::OnGetPosition:
 				{
-					if (!amx_FindPublic(*i, message.buffer.at(0).c_str(), &amxIndex))
+					amxIndex = core->findCallback(i->first, i->second, message.array.at(4));
+					if (amxIndex >= 0)
 					{
-						amx_Push(*i, message.array.at(1));
-						amx_Push(*i, message.array.at(2));
-						amx_Push(*i, message.array.at(3));
-						amx_Exec(*i, NULL, amxIndex);
+						amx_Push(i->first, message.array.at(1));
+						amx_Push(i->first, message.array.at(2));
+						amx_Push(i->first, message.array.at(3));
+						amx_Exec(i->first, NULL, amxIndex);
 					}
 					break;
 				}
 			}
 		}
+		if (core->tickMessages > 0 && ++processedMessages >= core->tickMessages)
+		{
+			break;
+		}
+		if (core->tickMicroseconds > 0 && boost::chrono::steady_clock::now() - start >= boost::chrono::microseconds(core->tickMicroseconds))
+		{
+			break;
+		}
 	}
+	core->flushCommands();
 }
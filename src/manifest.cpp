@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "manifest.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/cstdint.hpp>
+
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#define MANIFEST_FILE "audiopacks/manifest.cache"
+
+Manifest::Manifest(const std::string &name) : prefix("audiopacks/" + name + "/")
+{
+	changed = false;
+	std::ifstream stream(MANIFEST_FILE);
+	std::string line;
+	while (std::getline(stream, line))
+	{
+		std::size_t location = line.find('\t');
+		if (location == std::string::npos)
+		{
+			continue;
+		}
+		Entry entry;
+		std::istringstream fields(line.substr(location + 1));
+		fields >> entry.size >> entry.modified >> std::hex >> entry.checksum;
+		if (fields)
+		{
+			entries[line.substr(0, location)] = entry;
+		}
+	}
+}
+
+Manifest::Entry::Entry()
+{
+	checksum = 0;
+	modified = 0;
+	size = 0;
+	used = false;
+}
+
+bool Manifest::find(const std::string &path, std::size_t size, std::time_t modified, boost::uint32_t &checksum)
+{
+	std::map<std::string, Entry>::iterator e = entries.find(path);
+	if (e == entries.end() || e->second.size != size || e->second.modified != static_cast<long long>(modified))
+	{
+		return false;
+	}
+	e->second.used = true;
+	checksum = e->second.checksum;
+	return true;
+}
+
+void Manifest::insert(const std::string &path, std::size_t size, std::time_t modified, boost::uint32_t checksum)
+{
+	Entry &entry = entries[path];
+	entry.checksum = checksum;
+	entry.modified = static_cast<long long>(modified);
+	entry.size = size;
+	entry.used = true;
+	changed = true;
+}
+
+bool Manifest::save()
+{
+	std::map<std::string, Entry>::iterator e = entries.begin();
+	while (e != entries.end())
+	{
+		if (!e->second.used && boost::algorithm::istarts_with(e->first, prefix))
+		{
+			entries.erase(e++);
+			changed = true;
+		}
+		else
+		{
+			++e;
+		}
+	}
+	if (!changed)
+	{
+		return true;
+	}
+	std::ofstream stream(MANIFEST_FILE, std::ios_base::out | std::ios_base::trunc);
+	for (e = entries.begin(); e != entries.end(); ++e)
+	{
+		stream << e->first << '\t' << e->second.size << ' ' << e->second.modified << ' ' << std::hex << std::uppercase << e->second.checksum << std::dec << '\n';
+	}
+	changed = false;
+	return static_cast<bool>(stream);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <boost/cstdint.hpp>
+
+#include <ctime>
+#include <map>
+#include <string>
+
+/*
+ * Remembers the checksum of every local pack file by path, size and
+ * modification time in audiopacks/manifest.cache, so unchanged files do
+ * not have to be read again when a pack is set.
+ */
+
+class Manifest
+{
+public:
+	Manifest(const std::string &name);
+
+	bool find(const std::string &path, std::size_t size, std::time_t modified, boost::uint32_t &checksum);
+	void insert(const std::string &path, std::size_t size, std::time_t modified, boost::uint32_t checksum);
+	bool save();
+private:
+	struct Entry
+	{
+		Entry();
+
+		boost::uint32_t checksum;
+		long long modified;
+		std::size_t size;
+		bool used;
+	};
+
+	bool changed;
+	std::map<std::string, Entry> entries;
+	std::string prefix;
+};
+
+#endif
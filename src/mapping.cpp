@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mapping.h"
+
+#include "crc.h"
+
+#include <boost/cstdint.hpp>
+
+#include <sdk/plugin.h>
+
+#if defined __LINUX__
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/types.h>
+
+	#include <fcntl.h>
+	#include <unistd.h>
+#else
+	#include <windows.h>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+
+#if defined __LINUX__
+	static const std::size_t checksumWindow = 16 * 1024 * 1024;
+#endif
+
+Mapping::Mapping()
+{
+	#if defined __LINUX__
+		descriptor = -1;
+	#else
+		data = NULL;
+		fileHandle = INVALID_HANDLE_VALUE;
+		mappingHandle = NULL;
+	#endif
+	size = 0;
+}
+
+Mapping::~Mapping()
+{
+	close();
+}
+
+bool Mapping::open(const std::string &path)
+{
+	close();
+	#if defined __LINUX__
+		descriptor = ::open(path.c_str(), O_RDONLY);
+		if (descriptor == -1)
+		{
+			return false;
+		}
+		struct stat status;
+		if (::fstat(descriptor, &status) == -1)
+		{
+			close();
+			return false;
+		}
+		size = static_cast<std::size_t>(status.st_size);
+	#else
+		fileHandle = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!::GetFileSizeEx(fileHandle, &fileSize))
+		{
+			close();
+			return false;
+		}
+		size = static_cast<std::size_t>(fileSize.QuadPart);
+		if (size)
+		{
+			mappingHandle = ::CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (!mappingHandle)
+			{
+				close();
+				return false;
+			}
+			data = static_cast<const char*>(::MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+			if (!data)
+			{
+				close();
+				return false;
+			}
+		}
+	#endif
+	return true;
+}
+
+bool Mapping::calculateChecksum(std::size_t length, boost::uint32_t &checksum) const
+{
+	if (length > size)
+	{
+		return false;
+	}
+	checksum = 0;
+	#if defined __LINUX__
+		for (std::size_t offset = 0; offset < length; offset += checksumWindow)
+		{
+			std::size_t window = std::min(checksumWindow, length - offset);
+			void *address = ::mmap(NULL, window, PROT_READ, MAP_SHARED, descriptor, static_cast<off_t>(offset));
+			if (address == MAP_FAILED)
+			{
+				return false;
+			}
+			::madvise(address, window, MADV_SEQUENTIAL);
+			checksum = CRC::calculate(static_cast<const char*>(address), window, checksum);
+			::munmap(address, window);
+		}
+	#else
+		if (length)
+		{
+			checksum = CRC::calculate(data, length);
+		}
+	#endif
+	return true;
+}
+
+void Mapping::close()
+{
+	#if defined __LINUX__
+		if (descriptor != -1)
+		{
+			::close(descriptor);
+			descriptor = -1;
+		}
+	#else
+		if (data)
+		{
+			::UnmapViewOfFile(data);
+		}
+		if (mappingHandle)
+		{
+			::CloseHandle(mappingHandle);
+			mappingHandle = NULL;
+		}
+		if (fileHandle != INVALID_HANDLE_VALUE)
+		{
+			::CloseHandle(fileHandle);
+			fileHandle = INVALID_HANDLE_VALUE;
+		}
+		data = NULL;
+	#endif
+	size = 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <boost/cstdint.hpp>
+
+#include <sdk/plugin.h>
+
+#include <cstddef>
+#include <string>
+
+/*
+ * Read-only pack file. On Linux only the descriptor is kept, since
+ * sendfile needs nothing else; checksums map the file a window at a time
+ * so large packs do not exhaust a 32-bit address space. Elsewhere the
+ * whole file is mapped for the buffered writes.
+ */
+
+class Mapping
+{
+public:
+	Mapping();
+	~Mapping();
+
+	bool open(const std::string &path);
+
+	bool calculateChecksum(std::size_t length, boost::uint32_t &checksum) const;
+
+	#if !defined __LINUX__
+		inline const char *getData() const
+		{
+			return data;
+		}
+	#endif
+
+	#if defined __LINUX__
+		inline int getDescriptor() const
+		{
+			return descriptor;
+		}
+	#endif
+
+	inline std::size_t getSize() const
+	{
+		return size;
+	}
+private:
+	Mapping(const Mapping &);
+	Mapping &operator=(const Mapping &);
+
+	void close();
+
+	#if defined __LINUX__
+		int descriptor;
+	#else
+		const char *data;
+		void *fileHandle;
+		void *mappingHandle;
+	#endif
+	std::size_t size;
+};
+
+#endif
@@ -16,19 +16,22 @@
 
 #include "natives.h"
 
+#include "atomic.h"
 #include "core.h"
+#include "encoder.h"
 #include "main.h"
 #include "session.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
-#include <boost/format.hpp>
+#include <boost/chrono/chrono.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/unordered_map.hpp>
 
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
@@ -36,8 +39,11 @@
 
 cell AMX_NATIVE_CALL Natives::Audio_CreateTCPServer(AMX *amx, cell *params)
 {
-	CHECK_PARAMS(1, "Audio_CreateTCPServer");
-	boost::mutex::scoped_lock lock(core->mutex);
+	if (params[0] != 4 && params[0] != 8)
+	{
+		logprintf("*** Audio_CreateTCPServer: Expecting 1 or 2 parameter(s), but found %d", params[0] / 4);
+		return 0;
+	}
 	if (core->getServer()->isRunning())
 	{
 		return 0;
@@ -46,13 +52,21 @@ cell AMX_NATIVE_CALL Natives::Audio_CreateTCPServer(AMX *amx, cell *params)
 	{
 		return 0;
 	}
-	boost::thread startAsyncThread(&Server::startAsync, core->getServer());
+	std::size_t threads = 0;
+	if (params[0] == 8 && static_cast<int>(params[2]) > 0)
+	{
+		threads = static_cast<std::size_t>(params[2]);
+	}
+	else
+	{
+		threads = std::max<std::size_t>(boost::thread::hardware_concurrency(), 1);
+	}
+	core->getServer()->startAsync(threads);
 	return 1;
 }
 
 cell AMX_NATIVE_CALL Natives::Audio_DestroyTCPServer(AMX *amx, cell *params)
 {
-	boost::mutex::scoped_lock lock(core->mutex);
 	if (!core->getServer()->isRunning())
 	{
 		return 0;
@@ -64,7 +78,6 @@ cell AMX_NATIVE_CALL Natives::Audio_DestroyTCPServer(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_SetPack(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(3, "Audio_SetPack");
-	boost::mutex::scoped_lock lock(core->mutex);
 	char *name = NULL;
 	amx_StrParam(amx, params[1], name);
 	if (name == NULL)
@@ -74,12 +87,22 @@ cell AMX_NATIVE_CALL Natives::Audio_SetPack(AMX *amx, cell *params)
 	return static_cast<cell>(core->setPack(name, static_cast<int>(params[2]) != 0, static_cast<int>(params[3]) != 0));
 }
 
+cell AMX_NATIVE_CALL Natives::Audio_SetPackAsync(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(3, "Audio_SetPackAsync");
+	char *name = NULL;
+	amx_StrParam(amx, params[1], name);
+	if (name == NULL)
+	{
+		return 0;
+	}
+	return static_cast<cell>(core->setPackAsync(name, static_cast<int>(params[2]) != 0, static_cast<int>(params[3]) != 0));
+}
+
 cell AMX_NATIVE_CALL Natives::Audio_IsClientConnected(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(1, "Audio_IsClientConnected");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	if (core->getServer()->getClient(static_cast<int>(params[1])))
 	{
 		return 1;
 	}
@@ -89,17 +112,17 @@ cell AMX_NATIVE_CALL Natives::Audio_IsClientConnected(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_SendMessage(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_SendMessage");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
+		boost::mutex::scoped_lock lock(session->mutex);
 		char *message = NULL;
 		amx_StrParam(amx, params[2], message);
 		if (message == NULL)
 		{
 			return 0;
 		}
-		c->second->sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Message % message));
+		core->sendCommand(session, Encoder(Server::Message) << message);
 		return 1;
 	}
 	return 0;
@@ -108,27 +131,187 @@ cell AMX_NATIVE_CALL Natives::Audio_SendMessage(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_TransferPack(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(1, "Audio_TransferPack");
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::shared_lock<boost::shared_mutex> filesLock(core->filesMutex);
 	if (core->packAutomated || !core->packFiles)
 	{
 		return 0;
 	}
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	std::string packName = core->packName;
+	filesLock.unlock();
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
+	{
+		boost::mutex::scoped_lock lock(session->mutex);
+		if (session->transferring)
+		{
+			session->stopTransfer();
+		}
+		core->sendCommand(session, Encoder(Server::Connect) << packName);
+		session->startTransfer();
+	}
+	return 0;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_PrioritizeFile(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(2, "Audio_PrioritizeFile");
+	boost::shared_lock<boost::shared_mutex> filesLock(core->filesMutex);
+	if (core->files.find(static_cast<int>(params[2])) == core->files.end())
+	{
+		return 0;
+	}
+	filesLock.unlock();
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
+	{
+		boost::mutex::scoped_lock lock(session->mutex);
+		session->prioritizeFile(static_cast<int>(params[2]));
+		return 1;
+	}
+	return 0;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_SetQueuePolicy(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(1, "Audio_SetQueuePolicy");
+	switch (static_cast<int>(params[1]))
 	{
-		if (c->second->transferring)
+		case Core::Drop:
+		case Core::Coalesce:
+		case Core::Block:
 		{
-			c->second->stopTransfer();
+			Atomic::store(&core->queuePolicy, static_cast<long>(params[1]));
+			return 1;
 		}
-		c->second->sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Connect % core->packName));
-		c->second->startTransfer();
+	}
+	return 0;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_GetTickBudget(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(2, "Audio_GetTickBudget");
+	cell *messages = NULL, *microseconds = NULL;
+	amx_GetAddr(amx, params[1], &messages);
+	amx_GetAddr(amx, params[2], &microseconds);
+	*messages = static_cast<cell>(core->tickMessages);
+	*microseconds = static_cast<cell>(core->tickMicroseconds);
+	return 1;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_SetTickBudget(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(2, "Audio_SetTickBudget");
+	core->tickMessages = std::max<int>(static_cast<int>(params[1]), 0);
+	core->tickMicroseconds = std::max<int>(static_cast<int>(params[2]), 0);
+	return 1;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_SetTickBatching(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(1, "Audio_SetTickBatching");
+	core->tickBatching = static_cast<int>(params[1]) != 0;
+	if (!core->tickBatching)
+	{
+		core->flushCommands();
+	}
+	return 1;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_SetManifestBatching(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(1, "Audio_SetManifestBatching");
+	Atomic::store(&core->manifestBatching, static_cast<int>(params[1]) != 0);
+	return 1;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_SetLazyTransfer(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(2, "Audio_SetLazyTransfer");
+	if (static_cast<int>(params[2]) < 0)
+	{
+		return 0;
+	}
+	Atomic::store(&core->lazyTransferRate, static_cast<long>(params[2]));
+	Atomic::store(&core->lazyTransfer, static_cast<int>(params[1]) != 0);
+	return 1;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_SetTransferChunkSize(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(1, "Audio_SetTransferChunkSize");
+	if (static_cast<int>(params[1]) < 512 || static_cast<int>(params[1]) > 4194304)
+	{
+		return 0;
+	}
+	Atomic::store(&core->transferChunk, static_cast<long>(params[1]));
+	return 1;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_SetTransferRate(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(2, "Audio_SetTransferRate");
+	if (static_cast<int>(params[1]) < 0 || static_cast<int>(params[2]) < 0)
+	{
+		return 0;
+	}
+	Atomic::store(&core->transferRate, static_cast<long>(params[1]));
+	Atomic::store(&core->sessionTransferRate, static_cast<long>(params[2]));
+	return 1;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_SetTransferLimit(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(1, "Audio_SetTransferLimit");
+	if (static_cast<int>(params[1]) < 0)
+	{
+		return 0;
+	}
+	core->setTransferLimit(static_cast<int>(params[1]));
+	return 1;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_SetTransferWindow(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(1, "Audio_SetTransferWindow");
+	if (static_cast<int>(params[1]) < 1 || static_cast<int>(params[1]) > 16)
+	{
+		return 0;
+	}
+	Atomic::store(&core->transferWindow, static_cast<long>(params[1]));
+	return 1;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_GetTransferPosition(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(1, "Audio_GetTransferPosition");
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
+	{
+		return static_cast<cell>(core->getTransferPosition(session));
+	}
+	return 0;
+}
+
+cell AMX_NATIVE_CALL Natives::Audio_GetTransferStats(AMX *amx, cell *params)
+{
+	CHECK_PARAMS(3, "Audio_GetTransferStats");
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
+	{
+		boost::mutex::scoped_lock lock(session->mutex);
+		cell *kilobytes = NULL, *milliseconds = NULL;
+		amx_GetAddr(amx, params[2], &kilobytes);
+		amx_GetAddr(amx, params[3], &milliseconds);
+		*kilobytes = static_cast<cell>(session->transferredBytes / 1024);
+		*milliseconds = static_cast<cell>(boost::chrono::duration_cast<boost::chrono::milliseconds>(session->transferredTime).count());
+		return 1;
 	}
 	return 0;
 }
 
 cell AMX_NATIVE_CALL Natives::Audio_CreateSequence(AMX *amx, cell *params)
 {
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::mutex::scoped_lock lock(core->sequencesMutex);
 	int sequenceID = 1;
 	for (std::map<int, Data::Sequence>::iterator s = core->sequences.begin(); s != core->sequences.end(); ++s)
 	{
@@ -146,7 +329,7 @@ cell AMX_NATIVE_CALL Natives::Audio_CreateSequence(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_DestroySequence(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(1, "Audio_DestroySequence");
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::mutex::scoped_lock lock(core->sequencesMutex);
 	std::map<int, Data::Sequence>::iterator s = core->sequences.find(static_cast<int>(params[1]));
 	if (s != core->sequences.end())
 	{
@@ -159,16 +342,19 @@ cell AMX_NATIVE_CALL Natives::Audio_DestroySequence(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_AddToSequence(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_AddToSequence");
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::shared_lock<boost::shared_mutex> filesLock(core->filesMutex);
+	std::map<int, Data::File>::iterator f = core->files.find(static_cast<int>(params[2]));
+	if (f == core->files.end())
+	{
+		return 0;
+	}
+	filesLock.unlock();
+	boost::mutex::scoped_lock lock(core->sequencesMutex);
 	std::map<int, Data::Sequence>::iterator s = core->sequences.find(static_cast<int>(params[1]));
 	if (s != core->sequences.end())
 	{
-		std::map<int, Data::File>::iterator f = core->files.find(static_cast<int>(params[2]));
-		if (f != core->files.end())
-		{
-			s->second.audioIDs.push_back(static_cast<int>(params[2]));
-			return 1;
-		}
+		s->second.audioIDs.push_back(static_cast<int>(params[2]));
+		return 1;
 	}
 	return 0;
 }
@@ -176,7 +362,7 @@ cell AMX_NATIVE_CALL Natives::Audio_AddToSequence(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_RemoveFromSequence(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_RemoveFromSequence");
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::mutex::scoped_lock lock(core->sequencesMutex);
 	std::map<int, Data::Sequence>::iterator s = core->sequences.find(static_cast<int>(params[1]));
 	if (s != core->sequences.end())
 	{
@@ -205,7 +391,7 @@ cell AMX_NATIVE_CALL Natives::Audio_RemoveFromSequence(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_Play(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(5, "Audio_Play");
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::shared_lock<boost::shared_mutex> filesLock(core->filesMutex);
 	if (!core->packFiles)
 	{
 		return 0;
@@ -215,11 +401,13 @@ cell AMX_NATIVE_CALL Natives::Audio_Play(AMX *amx, cell *params)
 	{
 		return 0;
 	}
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	filesLock.unlock();
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
+		boost::mutex::scoped_lock lock(session->mutex);
 		int handleID = 1;
-		for (std::set<int>::iterator h = c->second->handles.begin(); h != c->second->handles.end(); ++h)
+		for (std::set<int>::iterator h = session->handles.begin(); h != session->handles.end(); ++h)
 		{
 			if (*h != handleID)
 			{
@@ -227,8 +415,13 @@ cell AMX_NATIVE_CALL Natives::Audio_Play(AMX *amx, cell *params)
 			}
 			++handleID;
 		}
-		c->second->handles.insert(handleID);
-		c->second->sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\t%4%\t%5%\t%6%\n") % Server::Play % static_cast<int>(params[2]) % handleID % static_cast<int>(params[3]) % static_cast<int>(params[4]) % static_cast<int>(params[5])));
+		session->handles.insert(handleID);
+		Encoder play(Server::Play);
+		play << static_cast<int>(params[2]) << handleID << static_cast<int>(params[3]) << static_cast<int>(params[4]) << static_cast<int>(params[5]);
+		if (!Atomic::load(&core->lazyTransfer) || !session->transferring || !session->deferPlay(static_cast<int>(params[2]), handleID, play))
+		{
+			core->sendCommand(session, play);
+		}
 		return static_cast<cell>(handleID);
 	}
 	return 0;
@@ -237,10 +430,10 @@ cell AMX_NATIVE_CALL Natives::Audio_Play(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_PlayStreamed(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(5, "Audio_PlaySteamed");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
+		boost::mutex::scoped_lock lock(session->mutex);
 		char *url = NULL;
 		amx_StrParam(amx, params[2], url);
 		if (url == NULL)
@@ -248,7 +441,7 @@ cell AMX_NATIVE_CALL Natives::Audio_PlayStreamed(AMX *amx, cell *params)
 			return 0;
 		}
 		int handleID = 1;
-		for (std::set<int>::iterator h = c->second->handles.begin(); h != c->second->handles.end(); ++h)
+		for (std::set<int>::iterator h = session->handles.begin(); h != session->handles.end(); ++h)
 		{
 			if (*h != handleID)
 			{
@@ -256,8 +449,8 @@ cell AMX_NATIVE_CALL Natives::Audio_PlayStreamed(AMX *amx, cell *params)
 			}
 			++handleID;
 		}
-		c->second->handles.insert(handleID);
-		c->second->sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\t%4%\t%5%\t%6%\n") % Server::Play % url % handleID % static_cast<int>(params[3]) % static_cast<int>(params[4]) % static_cast<int>(params[5])));
+		session->handles.insert(handleID);
+		core->sendCommand(session, Encoder(Server::Play) << url << handleID << static_cast<int>(params[3]) << static_cast<int>(params[4]) << static_cast<int>(params[5]));
 		return static_cast<cell>(handleID);
 	}
 	return 0;
@@ -266,11 +459,13 @@ cell AMX_NATIVE_CALL Natives::Audio_PlayStreamed(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_PlaySequence(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(5, "Audio_PlaySequence");
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::shared_lock<boost::shared_mutex> filesLock(core->filesMutex);
 	if (!core->packFiles)
 	{
 		return 0;
 	}
+	filesLock.unlock();
+	boost::mutex::scoped_lock sequencesLock(core->sequencesMutex);
 	std::map<int, Data::Sequence>::iterator s = core->sequences.find(static_cast<int>(params[2]));
 	if (s == core->sequences.end())
 	{
@@ -306,11 +501,13 @@ cell AMX_NATIVE_CALL Natives::Audio_PlaySequence(AMX *amx, cell *params)
 	{
 		output += "F";
 	}
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	sequencesLock.unlock();
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
+		boost::mutex::scoped_lock lock(session->mutex);
 		int handleID = 1;
-		for (std::set<int>::iterator h = c->second->handles.begin(); h != c->second->handles.end(); ++h)
+		for (std::set<int>::iterator h = session->handles.begin(); h != session->handles.end(); ++h)
 		{
 			if (*h != handleID)
 			{
@@ -318,8 +515,8 @@ cell AMX_NATIVE_CALL Natives::Audio_PlaySequence(AMX *amx, cell *params)
 			}
 			++handleID;
 		}
-		c->second->handles.insert(handleID);
-		c->second->sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\t%4%\t%5%\t%6%\t%7%\n") % Server::PlaySequence % static_cast<int>(params[2]) % handleID % static_cast<int>(params[3]) % static_cast<int>(params[4]) % static_cast<int>(params[5]) % output));
+		session->handles.insert(handleID);
+		core->sendCommand(session, Encoder(Server::PlaySequence) << static_cast<int>(params[2]) << handleID << static_cast<int>(params[3]) << static_cast<int>(params[4]) << static_cast<int>(params[5]) << output);
 		return static_cast<cell>(handleID);
 	}
 	return 0;
@@ -328,14 +525,14 @@ cell AMX_NATIVE_CALL Natives::Audio_PlaySequence(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_Pause(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_Pause");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
-			c->second->sendAsync(boost::str(boost::format("%1%\t%2%") % Server::Pause % static_cast<int>(params[2])));
+			core->sendCommand(session, Encoder(Server::Pause) << static_cast<int>(params[2]), static_cast<int>(params[2]));
 			return 1;
 		}
 	}
@@ -345,14 +542,14 @@ cell AMX_NATIVE_CALL Natives::Audio_Pause(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_Resume(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_Resume");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
-			c->second->sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Resume % static_cast<int>(params[2])));
+			core->sendCommand(session, Encoder(Server::Resume) << static_cast<int>(params[2]), static_cast<int>(params[2]));
 			return 1;
 		}
 	}
@@ -362,14 +559,17 @@ cell AMX_NATIVE_CALL Natives::Audio_Resume(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_Stop(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_Stop");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
-			c->second->sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Stop % static_cast<int>(params[2])));
+			if (!session->cancelPlay(static_cast<int>(params[2])))
+			{
+				core->sendCommand(session, Encoder(Server::Stop) << static_cast<int>(params[2]));
+			}
 			return 1;
 		}
 	}
@@ -379,14 +579,14 @@ cell AMX_NATIVE_CALL Natives::Audio_Stop(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_Restart(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_Restart");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
-			c->second->sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Restart % static_cast<int>(params[2])));
+			core->sendCommand(session, Encoder(Server::Restart) << static_cast<int>(params[2]), static_cast<int>(params[2]));
 			return 1;
 		}
 	}
@@ -396,12 +596,12 @@ cell AMX_NATIVE_CALL Natives::Audio_Restart(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_GetPosition(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(3, "Audio_GetPosition");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
 			char *callback = NULL;
 			amx_StrParam(amx, params[3], callback);
@@ -410,7 +610,7 @@ cell AMX_NATIVE_CALL Natives::Audio_GetPosition(AMX *amx, cell *params)
 				return 0;
 			}
 			int requestID = 1;
-			for (std::map<int, Data::Message>::iterator r = c->second->requests.begin(); r != c->second->requests.end(); ++r)
+			for (std::map<int, Data::Message>::iterator r = session->requests.begin(); r != session->requests.end(); ++r)
 			{
 				if (r->first != requestID)
 				{
@@ -420,9 +620,9 @@ cell AMX_NATIVE_CALL Natives::Audio_GetPosition(AMX *amx, cell *params)
 			}
 			Data::Message message;
 			message.array.push_back(Server::Position);
-			message.buffer.push_back(callback);
-			c->second->requests.insert(std::make_pair(requestID, message));
-			c->second->sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\n") % Server::GetPosition % requestID % static_cast<int>(params[2])));
+			message.array.push_back(core->internCallback(callback));
+			session->requests.insert(std::make_pair(requestID, message));
+			core->sendCommand(session, Encoder(Server::GetPosition) << requestID << static_cast<int>(params[2]), static_cast<int>(params[2]));
 			return 1;
 		}
 	}
@@ -432,16 +632,16 @@ cell AMX_NATIVE_CALL Natives::Audio_GetPosition(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_SetPosition(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(3, "Audio_SetPosition");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
 			if (static_cast<int>(params[3]) >= 0)
 			{
-				c->second->sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\n") % Server::SetPosition % static_cast<int>(params[2]) % static_cast<int>(params[3])));
+				core->sendCommand(session, Encoder(Server::SetPosition) << static_cast<int>(params[2]) << static_cast<int>(params[3]), static_cast<int>(params[2]));
 				return 1;
 			}
 		}
@@ -452,16 +652,16 @@ cell AMX_NATIVE_CALL Natives::Audio_SetPosition(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_SetVolume(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(3, "Audio_SetVolume");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
 			if (static_cast<int>(params[3]) >= 0 && static_cast<int>(params[3]) <= 100)
 			{
-				c->second->sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\n") % Server::SetVolume % static_cast<int>(params[2]) % static_cast<int>(params[3])));
+				core->sendCommand(session, Encoder(Server::SetVolume) << static_cast<int>(params[2]) << static_cast<int>(params[3]), static_cast<int>(params[2]));
 				return 1;
 			}
 		}
@@ -472,16 +672,16 @@ cell AMX_NATIVE_CALL Natives::Audio_SetVolume(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_SetFX(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(3, "Audio_SetFX");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
 			if (static_cast<int>(params[3]) >= 0 && static_cast<int>(params[3]) <= 8)
 			{
-				c->second->sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\n") % Server::SetFX % static_cast<int>(params[2]) % static_cast<int>(params[3])));
+				core->sendCommand(session, Encoder(Server::SetFX) << static_cast<int>(params[2]) << static_cast<int>(params[3]), static_cast<int>(params[2]));
 				return 1;
 			}
 		}
@@ -492,14 +692,14 @@ cell AMX_NATIVE_CALL Natives::Audio_SetFX(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_RemoveFX(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(3, "Audio_RemoveFX");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
-			c->second->sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\n") % Server::RemoveFX % static_cast<int>(params[2]) % static_cast<int>(params[3])));
+			core->sendCommand(session, Encoder(Server::RemoveFX) << static_cast<int>(params[2]) << static_cast<int>(params[3]), static_cast<int>(params[2]));
 			return 1;
 		}
 	}
@@ -509,14 +709,14 @@ cell AMX_NATIVE_CALL Natives::Audio_RemoveFX(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_Set3DPosition(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(6, "Audio_Set3DPosition");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
-			c->second->sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\t%4%\t%5%\t%6%\n") % Server::Set3DPosition % static_cast<int>(params[2]) % amx_ctof(params[3]) % amx_ctof(params[4]) % amx_ctof(params[5]) % amx_ctof(params[6])));
+			core->sendCommand(session, Encoder(Server::Set3DPosition) << static_cast<int>(params[2]) << amx_ctof(params[3]) << amx_ctof(params[4]) << amx_ctof(params[5]) << amx_ctof(params[6]), static_cast<int>(params[2]));
 			return 1;
 		}
 	}
@@ -526,14 +726,14 @@ cell AMX_NATIVE_CALL Natives::Audio_Set3DPosition(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_Remove3DPosition(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_Remove3DPosition");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		std::set<int>::iterator h = c->second->handles.find(static_cast<int>(params[2]));
-		if (h != c->second->handles.end())
+		boost::mutex::scoped_lock lock(session->mutex);
+		std::set<int>::iterator h = session->handles.find(static_cast<int>(params[2]));
+		if (h != session->handles.end())
 		{
-			c->second->sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Remove3DPosition % static_cast<int>(params[2])));
+			core->sendCommand(session, Encoder(Server::Remove3DPosition) << static_cast<int>(params[2]), static_cast<int>(params[2]));
 			return 1;
 		}
 	}
@@ -543,13 +743,13 @@ cell AMX_NATIVE_CALL Natives::Audio_Remove3DPosition(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_SetRadioStation(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_SetRadioStation");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
+		boost::mutex::scoped_lock lock(session->mutex);
 		if (static_cast<int>(params[2]) >= 0 && static_cast<int>(params[2]) <= 12)
 		{
-			c->second->sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::SetRadioStation % static_cast<int>(params[2])));
+			core->sendCommand(session, Encoder(Server::SetRadioStation) << static_cast<int>(params[2]));
 			return 1;
 		}
 	}
@@ -559,11 +759,11 @@ cell AMX_NATIVE_CALL Natives::Audio_SetRadioStation(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_StopRadio(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(1, "Audio_StopRadio");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		c->second->sendAsync(boost::str(boost::format("%1%\n") % Server::StopRadio));
+		boost::mutex::scoped_lock lock(session->mutex);
+		core->sendCommand(session, Encoder(Server::StopRadio));
 		return 1;
 	}
 	return 0;
@@ -572,7 +772,10 @@ cell AMX_NATIVE_CALL Natives::Audio_StopRadio(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_AddPlayer(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(3, "Audio_AddPlayer");
-	boost::mutex::scoped_lock lock(core->mutex);
+	if (static_cast<int>(params[1]) < 0 || static_cast<int>(params[1]) >= MAX_PLAYERS)
+	{
+		return 0;
+	}
 	char *address = NULL, *name = NULL;
 	amx_StrParam(amx, params[2], address);
 	amx_StrParam(amx, params[3], name);
@@ -586,6 +789,7 @@ cell AMX_NATIVE_CALL Natives::Audio_AddPlayer(AMX *amx, cell *params)
 	{
 		return 0;
 	}
+	boost::mutex::scoped_lock lock(core->playersMutex);
 	std::map<int, Data::Player>::iterator p = core->players.find(static_cast<int>(params[1]));
 	if (p != core->players.end())
 	{
@@ -593,19 +797,20 @@ cell AMX_NATIVE_CALL Natives::Audio_AddPlayer(AMX *amx, cell *params)
 		{
 			return 0;
 		}
+		core->erasePlayer(p->first, p->second.name.front());
 		core->players.erase(p);
 	}
 	Data::Player player;
 	player.address = address;
 	player.name.push_back(name);
 	core->players.insert(std::make_pair(static_cast<int>(params[1]), player));
+	core->insertPlayer(static_cast<int>(params[1]), name);
 	return 1;
 }
 
 cell AMX_NATIVE_CALL Natives::Audio_RenamePlayer(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(2, "Audio_RenamePlayer");
-	boost::mutex::scoped_lock lock(core->mutex);
 	char *name = NULL;
 	amx_StrParam(amx, params[2], name);
 	if (name == NULL)
@@ -613,18 +818,24 @@ cell AMX_NATIVE_CALL Natives::Audio_RenamePlayer(AMX *amx, cell *params)
 		return 0;
 	}
 	amx_StrParam(amx, params[2], name);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
+		boost::mutex::scoped_lock lock(session->mutex);
+		boost::mutex::scoped_lock playersLock(core->playersMutex);
 		std::map<int, Data::Player>::iterator p = core->players.find(static_cast<int>(params[1]));
 		if (p != core->players.end())
 		{
+			core->erasePlayer(p->first, p->second.name.front());
 			p->second.name.front() = name;
+			core->insertPlayer(p->first, name);
 		}
-		c->second->playerName = name;
-		c->second->sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Name % name));
+		playersLock.unlock();
+		session->playerName = name;
+		core->sendCommand(session, Encoder(Server::Name) << name);
 		return 1;
 	}
+	boost::mutex::scoped_lock lock(core->playersMutex);
 	std::map<int, Data::Player>::iterator f = core->players.find(static_cast<int>(params[1]));
 	if (f != core->players.end())
 	{
@@ -641,15 +852,17 @@ cell AMX_NATIVE_CALL Natives::Audio_RenamePlayer(AMX *amx, cell *params)
 cell AMX_NATIVE_CALL Natives::Audio_RemovePlayer(AMX *amx, cell *params)
 {
 	CHECK_PARAMS(1, "Audio_RemovePlayer");
-	boost::mutex::scoped_lock lock(core->mutex);
-	boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(static_cast<int>(params[1]));
-	if (c != core->getServer()->clients.end())
+	SharedSession session = core->getServer()->getClient(static_cast<int>(params[1]));
+	if (session)
 	{
-		c->second->stopAsync();
+		boost::mutex::scoped_lock lock(session->mutex);
+		session->stopAsync();
 	}
+	boost::mutex::scoped_lock lock(core->playersMutex);
 	std::map<int, Data::Player>::iterator p = core->players.find(static_cast<int>(params[1]));
 	if (p != core->players.end())
 	{
+		core->erasePlayer(p->first, p->second.name.front());
 		core->players.erase(p);
 		return 1;
 	}
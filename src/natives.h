@@ -31,9 +31,23 @@ namespace Natives
 	cell AMX_NATIVE_CALL Audio_CreateTCPServer(AMX *amx, cell *params);
 	cell AMX_NATIVE_CALL Audio_DestroyTCPServer(AMX *amx, cell *params);
 	cell AMX_NATIVE_CALL Audio_SetPack(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetPackAsync(AMX *amx, cell *params);
 	cell AMX_NATIVE_CALL Audio_IsClientConnected(AMX *amx, cell *params);
 	cell AMX_NATIVE_CALL Audio_SendMessage(AMX *amx, cell *params);
 	cell AMX_NATIVE_CALL Audio_TransferPack(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_PrioritizeFile(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetQueuePolicy(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_GetTickBudget(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetTickBudget(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetTickBatching(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetManifestBatching(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetLazyTransfer(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetTransferChunkSize(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetTransferRate(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetTransferLimit(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_SetTransferWindow(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_GetTransferPosition(AMX *amx, cell *params);
+	cell AMX_NATIVE_CALL Audio_GetTransferStats(AMX *amx, cell *params);
 	cell AMX_NATIVE_CALL Audio_CreateSequence(AMX *amx, cell *params);
 	cell AMX_NATIVE_CALL Audio_DestroySequence(AMX *amx, cell *params);
 	cell AMX_NATIVE_CALL Audio_AddToSequence(AMX *amx, cell *params);
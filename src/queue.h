@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "atomic.h"
+
+#include <boost/scoped_array.hpp>
+
+#include <algorithm>
+
+/*
+ * Bounded multi-producer/single-consumer ring buffer. Each cell carries
+ * a sequence number that tells producers and the consumer whether it is
+ * free or filled, so neither side ever takes a lock.
+ */
+
+template <typename T>
+class Queue
+{
+public:
+	Queue(std::size_t size);
+
+	bool empty() const;
+	bool pop(T &value);
+	bool push(const T &value);
+private:
+	Queue(const Queue &);
+	Queue &operator=(const Queue &);
+
+	struct Cell
+	{
+		volatile long sequence;
+		T value;
+	};
+
+	boost::scoped_array<Cell> cells;
+	unsigned long mask;
+
+	char enqueuePadding[64];
+	volatile long enqueuePosition;
+	char dequeuePadding[64];
+	unsigned long dequeuePosition;
+};
+
+template <typename T>
+Queue<T>::Queue(std::size_t size)
+{
+	std::size_t capacity = 2;
+	while (capacity < size)
+	{
+		capacity <<= 1;
+	}
+	cells.reset(new Cell[capacity]);
+	for (std::size_t i = 0; i < capacity; ++i)
+	{
+		cells[i].sequence = static_cast<long>(i);
+	}
+	dequeuePosition = 0;
+	enqueuePosition = 0;
+	mask = static_cast<unsigned long>(capacity - 1);
+}
+
+template <typename T>
+bool Queue<T>::empty() const
+{
+	const Cell &cell = cells[dequeuePosition & mask];
+	return static_cast<long>(static_cast<unsigned long>(Atomic::load(&cell.sequence)) - (dequeuePosition + 1)) < 0;
+}
+
+template <typename T>
+bool Queue<T>::pop(T &value)
+{
+	Cell &cell = cells[dequeuePosition & mask];
+	long difference = static_cast<long>(static_cast<unsigned long>(Atomic::load(&cell.sequence)) - (dequeuePosition + 1));
+	if (difference < 0)
+	{
+		return false;
+	}
+	using std::swap;
+	swap(value, cell.value);
+	cell.value = T();
+	Atomic::store(&cell.sequence, static_cast<long>(dequeuePosition + mask + 1));
+	++dequeuePosition;
+	return true;
+}
+
+template <typename T>
+bool Queue<T>::push(const T &value)
+{
+	Cell *cell = NULL;
+	unsigned long position = static_cast<unsigned long>(Atomic::load(&enqueuePosition));
+	while (true)
+	{
+		cell = &cells[position & mask];
+		long difference = static_cast<long>(static_cast<unsigned long>(Atomic::load(&cell->sequence)) - position);
+		if (!difference)
+		{
+			if (Atomic::compareExchange(&enqueuePosition, static_cast<long>(position + 1), static_cast<long>(position)) == static_cast<long>(position))
+			{
+				break;
+			}
+		}
+		else if (difference < 0)
+		{
+			return false;
+		}
+		position = static_cast<unsigned long>(Atomic::load(&enqueuePosition));
+	}
+	cell->value = value;
+	Atomic::store(&cell->sequence, static_cast<long>(position + 1));
+	return true;
+}
+
+#endif
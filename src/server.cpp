@@ -16,65 +16,100 @@
 
 #include "server.h"
 
+#include "atomic.h"
 #include "core.h"
 #include "main.h"
 #include "session.h"
 
 #include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include <boost/unordered_map.hpp>
 
 #include <sdk/plugin.h>
 
 #include <set>
+#include <vector>
+
+Server::Server()
+{
+	port = 0;
+}
 
 void Server::handleAccept(const boost::system::error_code &error, SharedSession session)
 {
-	boost::mutex::scoped_lock lock(core->mutex);
-	if (acceptor)
+	if (!isRunning())
 	{
-		if (!error)
-		{
-			session->startAsync();
-			startAccept();
-		}
+		return;
+	}
+	if (!error)
+	{
+		boost::mutex::scoped_lock lock(session->mutex);
+		session->startAsync();
+		lock.unlock();
+		startAccept();
 	}
 }
 
 void Server::startAccept()
 {
-	SharedSession session(new Session(io_service));
-	acceptor->async_accept(session->sessionSocket, boost::bind(&Server::handleAccept, this, boost::asio::placeholders::error, session));
+	boost::shared_lock<boost::shared_mutex> lock(mutex);
+	if (acceptor)
+	{
+		SharedSession session(new Session(io_service));
+		acceptor->async_accept(session->sessionSocket, boost::bind(&Server::handleAccept, this, boost::asio::placeholders::error, session));
+	}
 }
 
-void Server::startAsync()
+void Server::runAsync()
 {
-	unsigned short port = acceptor->local_endpoint().port();
-	logprintf("*** Audio Plugin: Started TCP server on port %d", port);
-	io_service.reset();
 	boost::system::error_code error;
 	io_service.run(error);
-	logprintf("*** Audio Plugin: Stopped TCP server on port %d", port);
+}
+
+void Server::startAsync(std::size_t threads)
+{
+	boost::shared_lock<boost::shared_mutex> lock(mutex);
+	port = acceptor->local_endpoint().port();
+	lock.unlock();
+	Atomic::store(&core->queueStopped, 0);
+	io_service.reset();
+	for (std::size_t i = 0; i < threads; ++i)
+	{
+		runAsyncThreads.create_thread(boost::bind(&Server::runAsync, this));
+	}
+	logprintf("*** Audio Plugin: Started TCP server on port %d (%d network thread(s))", port, static_cast<int>(threads));
 }
 
 void Server::stopAsync()
 {
+	Atomic::store(&core->queueStopped, 1);
+	boost::unique_lock<boost::shared_mutex> lock(mutex);
 	if (acceptor)
 	{
-		acceptor->close();
+		boost::system::error_code error;
+		acceptor->close(error);
 		acceptor.reset();
-		for (std::set<SharedSession>::iterator c = sessions.begin(); c != sessions.end(); ++c)
+		std::vector<SharedSession> stoppedSessions(sessions.begin(), sessions.end());
+		addresses.clear();
+		clients.clear();
+		sessions.clear();
+		lock.unlock();
+		for (std::vector<SharedSession>::iterator c = stoppedSessions.begin(); c != stoppedSessions.end(); ++c)
 		{
+			boost::mutex::scoped_lock sessionLock((*c)->mutex);
 			(*c)->connected = false;
 			(*c)->stopAsync();
 		}
-		clients.clear();
-		sessions.clear();
 	}
 	io_service.stop();
+	runAsyncThreads.join_all();
+	logprintf("*** Audio Plugin: Stopped TCP server on port %d", port);
 }
 
 bool Server::createAcceptor(unsigned short port)
 {
+	boost::unique_lock<boost::shared_mutex> lock(mutex);
 	boost::system::error_code error;
 	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
 	acceptor = SharedAcceptor(new boost::asio::ip::tcp::acceptor(io_service));
@@ -106,11 +141,30 @@ bool Server::createAcceptor(unsigned short port)
 		acceptor.reset();
 		return false;
 	}
+	lock.unlock();
 	startAccept();
 	return true;
 }
 
 bool Server::isRunning()
 {
+	boost::shared_lock<boost::shared_mutex> lock(mutex);
 	return (acceptor ? true : false);
 }
+
+SharedSession Server::getClient(int playerID)
+{
+	boost::shared_lock<boost::shared_mutex> lock(mutex);
+	boost::unordered_map<int, SharedSession>::iterator c = clients.find(playerID);
+	if (c != clients.end())
+	{
+		return c->second;
+	}
+	return SharedSession();
+}
+
+std::vector<SharedSession> Server::getSessions()
+{
+	boost::shared_lock<boost::shared_mutex> lock(mutex);
+	return std::vector<SharedSession>(sessions.begin(), sessions.end());
+}
@@ -20,21 +20,29 @@
 #include "common.h"
 
 #include <boost/asio.hpp>
+#include <boost/thread.hpp>
 #include <boost/unordered_map.hpp>
 
 #include <set>
+#include <string>
+#include <vector>
 
 class Server
 {
 	friend class Session;
 
 public:
-	void startAsync();
+	Server();
+
+	void startAsync(std::size_t threads);
 	void stopAsync();
 
 	bool createAcceptor(unsigned short port);
 	bool isRunning();
 
+	SharedSession getClient(int playerID);
+	std::vector<SharedSession> getSessions();
+
 	enum Commands
 	{
 		Connect,
@@ -56,7 +64,9 @@ public:
 		Remove3DPosition,
 		GetRadioStation,
 		SetRadioStation,
-		StopRadio
+		StopRadio,
+		Manifest,
+		Offset
 	};
 
 	enum Requests
@@ -64,15 +74,21 @@ public:
 		Position
 	};
 
+	boost::unordered_map<std::string, SharedSession> addresses;
 	boost::unordered_map<int, SharedSession> clients;
+	boost::shared_mutex mutex;
 	std::set<SharedSession> sessions;
 private:
 	void handleAccept(const boost::system::error_code &error, SharedSession session);
 
 	void startAccept();
 
+	void runAsync();
+
 	SharedAcceptor acceptor;
 	boost::asio::io_service io_service;
+	unsigned short port;
+	boost::thread_group runAsyncThreads;
 };
 
 #endif
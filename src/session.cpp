@@ -16,33 +16,47 @@
 
 #include "session.h"
 
+#include "atomic.h"
 #include "core.h"
+#include "encoder.h"
 #include "main.h"
+#include "mapping.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
+#include <boost/chrono/chrono.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/enable_shared_from_this.hpp>
-#include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/unordered_map.hpp>
 
-#include <fstream>
+#if defined __LINUX__
+	#include <sys/sendfile.h>
+	#include <sys/types.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <deque>
 #include <map>
-#include <queue>
 #include <set>
 #include <string>
 #include <vector>
 
-Session::Session(boost::asio::io_service &io_service) : heartbeatTimer(io_service), sessionSocket(io_service), transferTimer(io_service)
+Session::Session(boost::asio::io_service &io_service) : heartbeatTimer(io_service), receivedData(MAX_BUFFER, MAX_BUFFER * 16), sessionSocket(io_service), strand(io_service), throttleTimer(io_service), transferTimer(io_service)
 {
 	connected = false;
 	downloading = false;
 	missedResponse = false;
 	playerID = std::numeric_limits<int>::max();
+	staged = false;
+	throttled = false;
+	transferredBytes = 0;
+	transferredTime = boost::chrono::steady_clock::duration::zero();
 	transferring = false;
 	waitingForResponse = false;
 	writeInProgress = false;
@@ -51,13 +65,26 @@ Session::Session(boost::asio::io_service &io_service) : heartbeatTimer(io_servic
 Session::File::File()
 {
 	id = 0;
+	manifest = Unsent;
+	offset = 0;
+	prioritized = false;
+	replaying = false;
 	size = 0;
+	streaming = false;
 	transferred = 0;
 }
 
+Session::Offer::Offer()
+{
+	id = 0;
+	prioritized = false;
+	remote = false;
+	size = 0;
+}
+
 void Session::handleHeartbeatTimer(const boost::system::error_code &error)
 {
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::mutex::scoped_lock lock(mutex);
 	if (!error)
 	{
 		if (!file)
@@ -84,25 +111,16 @@ void Session::handleHeartbeatTimer(const boost::system::error_code &error)
 
 void Session::handleRead(const boost::system::error_code &error, std::size_t bytesTransferred)
 {
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::mutex::scoped_lock lock(mutex);
 	if (!error)
 	{
-		std::string buffer(receivedData);
-		buffer.resize(bytesTransferred);
-		boost::algorithm::erase_last(buffer, "\n");
-		boost::algorithm::split(messageTokens, buffer, boost::algorithm::is_any_of("\n"));
-		if (messageTokens.empty())
+		Framer::Line line;
+		receivedData.commit(bytesTransferred);
+		while (receivedData.next(line))
 		{
-			parseBuffer(buffer);
+			parseBuffer(line);
 		}
-		else
-		{
-			for (std::vector<std::string>::iterator i = messageTokens.begin(); i != messageTokens.end(); ++i)
-			{
-				parseBuffer(*i);
-			}
-		}
-		sessionSocket.async_read_some(boost::asio::buffer(receivedData), boost::bind(&Session::handleRead, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+		sessionSocket.async_read_some(receivedData.prepare(), strand.wrap(boost::bind(&Session::handleRead, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 	}
 	else
 	{
@@ -112,56 +130,79 @@ void Session::handleRead(const boost::system::error_code &error, std::size_t byt
 			Data::Message message;
 			message.array.push_back(Data::OnClientDisconnect);
 			message.array.push_back(playerID);
-			core->messages.push(message);
+			queuedMessages.push_back(message);
 			connected = false;
 		}
-		for (std::map<int, Data::File>::iterator f = core->files.begin(); f != core->files.end(); ++f)
+		boost::unique_lock<boost::shared_mutex> filesLock(core->filesMutex);
+		for (std::vector<int>::iterator r = receivedFiles.begin(); r != receivedFiles.end(); ++r)
 		{
-			f->second.players.erase(playerID);
+			std::map<int, Data::File>::iterator f = core->files.find(*r);
+			if (f != core->files.end() && f->second.hasPlayer(playerID))
+			{
+				f->second.players.reset(static_cast<std::size_t>(playerID));
+			}
 		}
+		filesLock.unlock();
+		receivedFiles.clear();
+		boost::mutex::scoped_lock sequencesLock(core->sequencesMutex);
 		for (std::map<int, Data::Sequence>::iterator s = core->sequences.begin(); s != core->sequences.end(); ++s)
 		{
 			s->second.transfers.erase(playerID);
 		}
+		sequencesLock.unlock();
 		stopAsync();
 	}
+	publishMessages(lock);
+}
+
+void Session::handleThrottleTimer(const boost::system::error_code &error)
+{
+	boost::mutex::scoped_lock lock(mutex);
+	throttled = false;
+	if ((!error || error == boost::asio::error::operation_aborted) && !writeInProgress)
+	{
+		transferFile();
+	}
+	publishMessages(lock);
 }
 
 void Session::handleTransferTimer(const boost::system::error_code &error)
 {
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::mutex::scoped_lock lock(mutex);
 	if (!error)
 	{
-		if (!pendingMessages.empty())
-		{
-			sendAsync(pendingMessages.front());
-			pendingMessages.pop();
-		}
+		flushAsync();
 		sendFileData();
 	}
+	publishMessages(lock);
 }
 
 void Session::handleWrite(const boost::system::error_code &error)
 {
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::mutex::scoped_lock lock(mutex);
 	writeInProgress = false;
 	if (!error)
 	{
-		if (!pendingMessages.empty())
+		if (downloading)
+		{
+			transferFile();
+		}
+		else
 		{
-			sendAsync(pendingMessages.front());
-			pendingMessages.pop();
+			flushAsync();
 		}
 	}
 	else
 	{
-		pendingMessages = std::queue<std::string>();
+		pendingData.clear();
 	}
+	publishMessages(lock);
 }
 
-void Session::handleWriteFile(const boost::system::error_code &error)
+void Session::handleWriteFile(const boost::system::error_code &error, SharedMapping mapping)
 {
-	boost::mutex::scoped_lock lock(core->mutex);
+	boost::mutex::scoped_lock lock(mutex);
+	writeInProgress = false;
 	if (!error)
 	{
 		transferFile();
@@ -170,20 +211,55 @@ void Session::handleWriteFile(const boost::system::error_code &error)
 	{
 		registerFile(Error);
 	}
+	if (!downloading)
+	{
+		flushAsync();
+	}
+	publishMessages(lock);
 }
 
-void Session::sendAsync(const std::string &buffer)
+void Session::publishMessages(boost::mutex::scoped_lock &lock)
 {
-	if (downloading || writeInProgress)
+	std::vector<Data::Message> messages;
+	messages.swap(queuedMessages);
+	lock.unlock();
+	for (std::vector<Data::Message>::iterator m = messages.begin(); m != messages.end(); ++m)
 	{
-		pendingMessages.push(buffer);
+		core->pushMessage(*m);
 	}
-	else
+}
+
+void Session::sendAsync(const Encoder &encoder)
+{
+	pendingData.append(encoder.getData(), encoder.getSize());
+	flushAsync();
+}
+
+void Session::sendAsync(const std::string &buffer)
+{
+	pendingData.append(buffer);
+	flushAsync();
+}
+
+void Session::stageAsync(const Encoder &encoder)
+{
+	pendingData.append(encoder.getData(), encoder.getSize());
+}
+
+void Session::flushAsync()
+{
+	if ((downloading && (!file || file->streaming)) || writeInProgress || pendingData.empty())
 	{
-		sentData = buffer;
-		writeInProgress = true;
-		boost::asio::async_write(sessionSocket, boost::asio::buffer(sentData, sentData.length()), boost::bind(&Session::handleWrite, shared_from_this(), boost::asio::placeholders::error));
+		if (downloading && !pendingData.empty())
+		{
+			expediteTransfer();
+		}
+		return;
 	}
+	sentData.swap(pendingData);
+	pendingData.clear();
+	writeInProgress = true;
+	boost::asio::async_write(sessionSocket, boost::asio::buffer(sentData), strand.wrap(boost::bind(&Session::handleWrite, shared_from_this(), boost::asio::placeholders::error)));
 }
 
 void Session::startAsync()
@@ -197,17 +273,17 @@ void Session::startAsync()
 	}
 	sessionAddress = remoteEndpoint.address().to_string();
 	sessionPort = remoteEndpoint.port();
-	for (std::set<SharedSession>::iterator c = core->getServer()->sessions.begin(); c != core->getServer()->sessions.end(); ++c)
+	boost::unique_lock<boost::shared_mutex> lock(core->getServer()->mutex);
+	if (!core->getServer()->addresses.insert(std::make_pair(sessionAddress, shared_from_this())).second)
 	{
-		if (boost::algorithm::equals((*c)->sessionAddress, sessionAddress))
-		{
-			stopAsync();
-			return;
-		}
+		lock.unlock();
+		stopAsync();
+		return;
 	}
-	sessionSocket.async_read_some(boost::asio::buffer(receivedData), boost::bind(&Session::handleRead, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
-	startHeartbeatTimer();
 	core->getServer()->sessions.insert(shared_from_this());
+	lock.unlock();
+	sessionSocket.async_read_some(receivedData.prepare(), strand.wrap(boost::bind(&Session::handleRead, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+	startHeartbeatTimer();
 }
 
 void Session::stopAsync()
@@ -219,49 +295,188 @@ void Session::stopAsync()
 		sessionSocket.close(error);
 		stopHeartbeatTimer();
 		stopTransferTimer();
+		throttleTimer.cancel(error);
+		setDownloading(false);
+		core->releaseTransfer(shared_from_this());
 	}
-	if (core->getServer()->isRunning())
+	boost::unique_lock<boost::shared_mutex> lock(core->getServer()->mutex);
+	if (core->getServer()->acceptor)
 	{
 		boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(playerID);
-		if (c != core->getServer()->clients.end())
+		if (c != core->getServer()->clients.end() && c->second.get() == this)
+		{
+			core->getServer()->clients.erase(c);
+		}
+		boost::unordered_map<std::string, SharedSession>::iterator a = core->getServer()->addresses.find(sessionAddress);
+		if (a != core->getServer()->addresses.end() && a->second.get() == this)
 		{
-			core->getServer()->clients.erase(playerID);
+			core->getServer()->addresses.erase(a);
 		}
 		core->getServer()->sessions.erase(shared_from_this());
 	}
 }
 
+bool Session::cancelPlay(int handleID)
+{
+	for (std::multimap<int, std::pair<int, std::string> >::iterator p = deferredPlays.begin(); p != deferredPlays.end(); ++p)
+	{
+		if (p->second.first == handleID)
+		{
+			Data::Message message;
+			message.array.push_back(Data::OnStop);
+			message.array.push_back(handleID);
+			message.array.push_back(playerID);
+			queuedMessages.push_back(message);
+			handles.erase(handleID);
+			deferredPlays.erase(p);
+			return true;
+		}
+	}
+	return false;
+}
+
+void Session::clearReceivedFiles()
+{
+	if (playerID >= 0 && playerID < MAX_PLAYERS)
+	{
+		boost::unique_lock<boost::shared_mutex> lock(core->filesMutex);
+		for (std::map<int, Data::File>::iterator f = core->files.begin(); f != core->files.end(); ++f)
+		{
+			f->second.players.reset(static_cast<std::size_t>(playerID));
+		}
+	}
+	receivedFiles.clear();
+}
+
+bool Session::deferCommand(int handleID, const Encoder &encoder)
+{
+	for (std::multimap<int, std::pair<int, std::string> >::iterator p = deferredPlays.begin(); p != deferredPlays.end(); ++p)
+	{
+		if (p->second.first == handleID)
+		{
+			p->second.second.append(encoder.getData(), encoder.getSize());
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Session::deferPlay(int fileID, int handleID, const Encoder &encoder)
+{
+	boost::shared_lock<boost::shared_mutex> lock(core->filesMutex);
+	std::map<int, Data::File>::iterator f = core->files.find(fileID);
+	if (f == core->files.end() || f->second.hasPlayer(playerID))
+	{
+		return false;
+	}
+	lock.unlock();
+	deferredPlays.insert(std::make_pair(fileID, std::make_pair(handleID, std::string(encoder.getData(), encoder.getSize()))));
+	prioritizeFile(fileID);
+	return true;
+}
+
+void Session::prioritizeFile(int fileID)
+{
+	if (file)
+	{
+		if (downloading && file->id == fileID)
+		{
+			return;
+		}
+		for (std::deque<Offer>::iterator o = file->offers.begin(); o != file->offers.end(); ++o)
+		{
+			if (o->id == fileID)
+			{
+				return;
+			}
+		}
+	}
+	std::deque<int>::iterator p = std::find(priorityFiles.begin(), priorityFiles.end(), fileID);
+	if (p != priorityFiles.end())
+	{
+		priorityFiles.erase(p);
+	}
+	priorityFiles.push_front(fileID);
+	expediteTransfer();
+}
+
+void Session::beginTransferAsync()
+{
+	strand.post(boost::bind(&Session::handleBeginTransfer, shared_from_this()));
+}
+
 void Session::startTransfer()
 {
-	file = boost::shared_ptr<File>(new File);
-	missedResponse = false;
-	waitingForResponse = false;
 	transferring = true;
-	startTransferTimer();
+	if (core->acquireTransfer(shared_from_this()))
+	{
+		beginTransfer();
+	}
 }
 
 void Session::stopTransfer()
 {
 	if (downloading)
 	{
-		downloading = false;
+		setDownloading(false);
 		sendAsync("CANCEL");
 	}
+	for (std::multimap<int, std::pair<int, std::string> >::iterator p = deferredPlays.begin(); p != deferredPlays.end(); ++p)
+	{
+		handles.erase(p->second.first);
+	}
+	deferredPlays.clear();
+	priorityFiles.clear();
 	file.reset();
 	transferring = false;
 	stopTransferTimer();
+	core->releaseTransfer(shared_from_this());
+}
+
+void Session::beginTransfer()
+{
+	file = boost::shared_ptr<File>(new File);
+	boost::shared_lock<boost::shared_mutex> lock(core->filesMutex);
+	for (std::map<int, Data::File>::iterator f = core->files.begin(); f != core->files.end(); ++f)
+	{
+		if (!f->second.hasPlayer(playerID))
+		{
+			file->pending.push_back(f->first);
+		}
+	}
+	lock.unlock();
+	missedResponse = false;
+	waitingForResponse = false;
+	startTransferTimer();
+}
+
+void Session::handleBeginTransfer()
+{
+	boost::mutex::scoped_lock lock(mutex);
+	if (connected && transferring && !file && core->hasTransfer(shared_from_this()))
+	{
+		beginTransfer();
+	}
 }
 
 void Session::startHeartbeatTimer()
 {
 	heartbeatTimer.expires_from_now(boost::posix_time::seconds(10));
-	heartbeatTimer.async_wait(boost::bind(&Session::handleHeartbeatTimer, shared_from_this(), boost::asio::placeholders::error));
+	heartbeatTimer.async_wait(strand.wrap(boost::bind(&Session::handleHeartbeatTimer, shared_from_this(), boost::asio::placeholders::error)));
+}
+
+void Session::startThrottleTimer()
+{
+	boost::chrono::microseconds delay = boost::chrono::duration_cast<boost::chrono::microseconds>(transferBucket.getDelay());
+	throttled = true;
+	throttleTimer.expires_from_now(boost::posix_time::microseconds(std::max(delay.count(), static_cast<boost::int_least64_t>(1000))));
+	throttleTimer.async_wait(strand.wrap(boost::bind(&Session::handleThrottleTimer, shared_from_this(), boost::asio::placeholders::error)));
 }
 
 void Session::startTransferTimer()
 {
 	transferTimer.expires_from_now(boost::posix_time::seconds(1));
-	transferTimer.async_wait(boost::bind(&Session::handleTransferTimer, shared_from_this(), boost::asio::placeholders::error));
+	transferTimer.async_wait(strand.wrap(boost::bind(&Session::handleTransferTimer, shared_from_this(), boost::asio::placeholders::error)));
 }
 
 void Session::stopHeartbeatTimer()
@@ -276,31 +491,15 @@ void Session::stopTransferTimer()
 	transferTimer.cancel(error);
 }
 
-void Session::parseBuffer(const std::string &buffer)
+void Session::parseBuffer(const Framer::Line &buffer)
 {
 	if (buffer.empty())
 	{
 		waitingForResponse = false;
 		return;
 	}
-	boost::algorithm::split(commandTokens, buffer, boost::algorithm::is_any_of("\t"));
-	if (commandTokens.size() < 2 || commandTokens.size() > 4)
-	{
-		return;
-	}
-	for (std::vector<std::string>::iterator i = commandTokens.begin(); i != commandTokens.end(); ++i)
-	{
-		if (i->empty())
-		{
-			return;
-		}
-	}
 	int command = 0;
-	try
-	{
-		command = boost::lexical_cast<int>(commandTokens.at(0));
-	}
-	catch (boost::bad_lexical_cast &)
+	if (!commandTokens.parse(buffer) || !commandTokens.getCommand(command))
 	{
 		return;
 	}
@@ -312,6 +511,14 @@ void Session::parseBuffer(const std::string &buffer)
 		}
 		case Transfer:
 		{
+			if (downloading && file)
+			{
+				if (file->replies.size() < file->offers.size())
+				{
+					file->replies.push_back(std::string(buffer.begin(), buffer.end()));
+				}
+				return;
+			}
 			return performTransfer();
 		}
 		case Play:
@@ -338,103 +545,172 @@ void Session::parseBuffer(const std::string &buffer)
 		{
 			return performPosition();
 		}
+		case Manifest:
+		{
+			return performManifest();
+		}
 	}
 }
 
 void Session::performAuthenticate()
 {
-	if (connected || commandTokens.size() != 3)
+	typedef Tokenizer::Schema<3> Schema;
+	if (connected || !commandTokens.matches<Schema>())
 	{
 		return;
 	}
-	if (!boost::algorithm::equals(CLIENT_VERSION, commandTokens.at(2)))
+	if (!boost::algorithm::equals(CLIENT_VERSION, commandTokens.getString<Schema, 2>()))
 	{
-		sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Message % (boost::str(boost::format("This server only supports client version %1%") % CLIENT_VERSION))));
+		sendAsync(Encoder(Server::Message) << "This server only supports client version " CLIENT_VERSION);
 		stopAsync();
 		return;
 	}
-	for (std::map<int, Data::Player>::iterator p = core->players.begin(); p != core->players.end(); ++p)
+	bool found = false, renamed = false;
+	int id = 0;
+	std::string address, name = boost::copy_range<std::string>(commandTokens.getString<Schema, 1>());
+	boost::mutex::scoped_lock playersLock(core->playersMutex);
+	std::map<int, Data::Player>::iterator p = core->players.find(core->findPlayer(name));
+	if (p != core->players.end())
+	{
+		address = p->second.address;
+		found = true;
+		id = p->first;
+	}
+	playersLock.unlock();
+	if (!found)
 	{
-		if (boost::algorithm::equals(p->second.name.front(), commandTokens.at(1)))
+		sendAsync(Encoder(Server::Message) << "Player not connected");
+		stopAsync();
+		return;
+	}
+	if (core->getServer()->getClient(id))
+	{
+		sendAsync(Encoder(Server::Message) << "Player already connected");
+		stopAsync();
+		return;
+	}
+	if (!boost::algorithm::equals(sessionAddress, address))
+	{
+		sendAsync(Encoder(Server::Message) << "IP address does not match");
+		stopAsync();
+		return;
+	}
+	boost::unique_lock<boost::shared_mutex> serverLock(core->getServer()->mutex);
+	bool inserted = core->getServer()->clients.insert(std::make_pair(id, shared_from_this())).second;
+	serverLock.unlock();
+	if (!inserted)
+	{
+		sendAsync(Encoder(Server::Message) << "Player already connected");
+		stopAsync();
+		return;
+	}
+	playersLock.lock();
+	p = core->players.find(id);
+	if (p != core->players.end())
+	{
+		if (p->second.name.size() > 1)
 		{
-			boost::unordered_map<int, SharedSession>::iterator c = core->getServer()->clients.find(p->first);
-			if (c != core->getServer()->clients.end())
-			{
-				sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Message % "Player already connected"));
-				stopAsync();
-				return;
-			}
-			if (boost::algorithm::equals(sessionAddress, p->second.address))
-			{
-				if (p->second.name.size() > 1)
-				{
-					p->second.name.front() = p->second.name.back();
-					p->second.name.pop_back();
-					sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Name % p->second.name.front()));
-				}
-				if (core->packFiles)
-				{
-					sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Connect % core->packName));
-					if (core->packAutomated)
-					{
-						startTransfer();
-					}
-				}
-				else
-				{
-					sendAsync(boost::str(boost::format("%1%\n") % Server::Connect));
-				}
-				logprintf("*** Audio Plugin: %s (ID: %d) has connected", p->second.name.front().c_str(), p->first);
-				Data::Message message;
-				message.array.push_back(Data::OnClientConnect);
-				message.array.push_back(p->first);
-				core->messages.push(message);
-				connected = true;
-				playerID = p->first;
-				playerName = p->second.name.front();
-				break;
-			}
-			else
-			{
-				sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Message % "IP address does not match"));
-				stopAsync();
-				return;
-			}
-			break;
+			core->erasePlayer(id, p->second.name.front());
+			p->second.name.front() = p->second.name.back();
+			p->second.name.pop_back();
+			core->insertPlayer(id, p->second.name.front());
+			renamed = true;
 		}
+		name = p->second.name.front();
 	}
-	if (!connected)
+	playersLock.unlock();
+	if (renamed)
 	{
-		sendAsync(boost::str(boost::format("%1%\t%2%\n") % Server::Message % "Player not connected"));
-		stopAsync();
+		sendAsync(Encoder(Server::Name) << name);
+	}
+	boost::shared_lock<boost::shared_mutex> filesLock(core->filesMutex);
+	bool packAutomated = core->packAutomated;
+	int packFiles = core->packFiles;
+	std::string packName = core->packName;
+	filesLock.unlock();
+	if (packFiles)
+	{
+		sendAsync(Encoder(Server::Connect) << packName);
+		if (packAutomated)
+		{
+			startTransfer();
+		}
 	}
 	else
 	{
-		core->getServer()->clients.insert(std::make_pair(playerID, shared_from_this()));
+		sendAsync(Encoder(Server::Connect));
 	}
+	logprintf("*** Audio Plugin: %s (ID: %d) has connected", name.c_str(), id);
+	Data::Message message;
+	message.array.push_back(Data::OnClientConnect);
+	message.array.push_back(id);
+	queuedMessages.push_back(message);
+	connected = true;
+	playerID = id;
+	playerName = name;
 }
 
 void Session::performTransfer()
 {
-	if (!connected || downloading || !file || commandTokens.size() != 2)
+	typedef Tokenizer::Schema<2> Schema;
+	typedef Tokenizer::Schema<4> ResumeSchema;
+	int code = 0, resumeOffset = 0;
+	boost::uint32_t resumeChecksum = 0;
+	bool resuming = commandTokens.matches<ResumeSchema>();
+	if (!connected || downloading || !file || file->offers.empty())
 	{
 		return;
 	}
-	int code = 0;
-	try
+	if (resuming)
 	{
-		code = boost::lexical_cast<int>(commandTokens.at(1));
+		if (!commandTokens.getInteger<ResumeSchema, 1>(code) || !commandTokens.getInteger<ResumeSchema, 2>(resumeOffset) || !commandTokens.getHex<ResumeSchema, 3>(resumeChecksum) || code != Local)
+		{
+			return;
+		}
 	}
-	catch (boost::bad_lexical_cast &)
+	else if (!commandTokens.matches<Schema>() || !commandTokens.getInteger<Schema, 1>(code))
 	{
 		return;
 	}
+	Offer offer = file->offers.front();
+	file->offers.pop_front();
+	file->id = offer.id;
+	file->prioritized = offer.prioritized;
+	file->size = offer.size;
 	switch (code)
 	{
 		case Local:
 		{
-			downloading = true;
-			transferFile();
+			if (!offer.remote)
+			{
+				file->mapping = core->getMapping(offer.path);
+			}
+			if (resuming)
+			{
+				std::size_t offset = 0;
+				boost::uint32_t checksum = 0;
+				if (file->mapping && resumeOffset > 0 && static_cast<std::size_t>(resumeOffset) < file->mapping->getSize())
+				{
+					if (file->mapping->calculateChecksum(static_cast<std::size_t>(resumeOffset), checksum) && checksum == resumeChecksum)
+					{
+						offset = static_cast<std::size_t>(resumeOffset);
+					}
+				}
+				file->offset = offset;
+				sendAsync(Encoder(Server::Offset) << static_cast<unsigned long>(offset));
+			}
+			file->streaming = false;
+			setDownloading(true);
+			file->start = boost::chrono::steady_clock::now();
+			if (!offer.remote && !file->mapping)
+			{
+				registerFile(Error);
+				break;
+			}
+			if (!writeInProgress)
+			{
+				transferFile();
+			}
 			break;
 		}
 		case Remote:
@@ -449,17 +725,9 @@ void Session::performTransfer()
 
 void Session::performPlay()
 {
-	if (!connected || commandTokens.size() != 3)
-	{
-		return;
-	}
+	typedef Tokenizer::Schema<3> Schema;
 	int handleID = 0, result = 0;
-	try
-	{
-		handleID = boost::lexical_cast<int>(commandTokens.at(1));
-		result = boost::lexical_cast<int>(commandTokens.at(2));
-	}
-	catch (boost::bad_lexical_cast &)
+	if (!connected || !commandTokens.matches<Schema>() || !commandTokens.getInteger<Schema, 1>(handleID) || !commandTokens.getInteger<Schema, 2>(result))
 	{
 		return;
 	}
@@ -474,7 +742,7 @@ void Session::performPlay()
 				message.array.push_back(Data::OnPlay);
 				message.array.push_back(handleID);
 				message.array.push_back(playerID);
-				core->messages.push(message);
+				queuedMessages.push_back(message);
 				break;
 			}
 			case Failure:
@@ -488,20 +756,13 @@ void Session::performPlay()
 
 void Session::performSequence()
 {
-	if (!connected || commandTokens.size() != 3)
-	{
-		return;
-	}
+	typedef Tokenizer::Schema<3> Schema;
 	int handleID = 0, sequenceID = 0;
-	try
-	{
-		sequenceID = boost::lexical_cast<int>(commandTokens.at(1));
-		handleID = boost::lexical_cast<int>(commandTokens.at(2));
-	}
-	catch (boost::bad_lexical_cast &)
+	if (!connected || !commandTokens.matches<Schema>() || !commandTokens.getInteger<Schema, 1>(sequenceID) || !commandTokens.getInteger<Schema, 2>(handleID))
 	{
 		return;
 	}
+	boost::mutex::scoped_lock lock(core->sequencesMutex);
 	std::map<int, Data::Sequence>::iterator s = core->sequences.find(sequenceID);
 	if (s == core->sequences.end())
 	{
@@ -542,21 +803,15 @@ void Session::performSequence()
 		output += "F";
 		s->second.transfers.erase(t);
 	}
-	sendAsync(boost::str(boost::format("%1%\t%2%\t%3%\n") % Server::PlaySequence % handleID % output));
+	lock.unlock();
+	sendAsync(Encoder(Server::PlaySequence) << handleID << output);
 }
 
 void Session::performStop()
 {
-	if (!connected || commandTokens.size() != 2)
-	{
-		return;
-	}
+	typedef Tokenizer::Schema<2> Schema;
 	int handleID = 0;
-	try
-	{
-		handleID = boost::lexical_cast<int>(commandTokens.at(1));
-	}
-	catch (boost::bad_lexical_cast &)
+	if (!connected || !commandTokens.matches<Schema>() || !commandTokens.getInteger<Schema, 1>(handleID))
 	{
 		return;
 	}
@@ -567,27 +822,19 @@ void Session::performStop()
 		message.array.push_back(Data::OnStop);
 		message.array.push_back(handleID);
 		message.array.push_back(playerID);
-		core->messages.push(message);
+		queuedMessages.push_back(message);
 		handles.erase(h);
 	}
 }
 
 void Session::performTrack()
 {
-	if (!connected || commandTokens.size() != 3)
-	{
-		return;
-	}
+	typedef Tokenizer::Schema<3> Schema;
 	int handleID = 0;
-	try
-	{
-		handleID = boost::lexical_cast<int>(commandTokens.at(1));
-	}
-	catch (boost::bad_lexical_cast &)
+	if (!connected || !commandTokens.matches<Schema>() || !commandTokens.getInteger<Schema, 1>(handleID))
 	{
 		return;
 	}
-	boost::algorithm::replace_all(commandTokens.at(2), "%", "");
 	std::set<int>::iterator h = handles.find(handleID);
 	if (h != handles.end())
 	{
@@ -595,23 +842,16 @@ void Session::performTrack()
 		message.array.push_back(Data::OnTrackChange);
 		message.array.push_back(handleID);
 		message.array.push_back(playerID);
-		message.buffer.push_back(commandTokens.at(2));
-		core->messages.push(message);
+		message.buffer.push_back(boost::algorithm::erase_all_copy(boost::copy_range<std::string>(commandTokens.getString<Schema, 2>()), "%"));
+		queuedMessages.push_back(message);
 	}
 }
 
 void Session::performRadioStation()
 {
-	if (!connected || commandTokens.size() != 2)
-	{
-		return;
-	}
+	typedef Tokenizer::Schema<2> Schema;
 	int radioStation = 0;
-	try
-	{
-		radioStation = boost::lexical_cast<int>(commandTokens.at(1));
-	}
-	catch (boost::bad_lexical_cast &)
+	if (!connected || !commandTokens.matches<Schema>() || !commandTokens.getInteger<Schema, 1>(radioStation))
 	{
 		return;
 	}
@@ -623,23 +863,14 @@ void Session::performRadioStation()
 	message.array.push_back(Data::OnRadioStationChange);
 	message.array.push_back(radioStation);
 	message.array.push_back(playerID);
-	core->messages.push(message);
+	queuedMessages.push_back(message);
 }
 
 void Session::performPosition()
 {
-	if (!connected || commandTokens.size() != 4)
-	{
-		return;
-	}
+	typedef Tokenizer::Schema<4> Schema;
 	int handleID = 0, requestID = 0, seconds = 0;
-	try
-	{
-		requestID = boost::lexical_cast<int>(commandTokens.at(1));
-		handleID = boost::lexical_cast<int>(commandTokens.at(2));
-		seconds = boost::lexical_cast<int>(commandTokens.at(3));
-	}
-	catch (boost::bad_lexical_cast &)
+	if (!connected || !commandTokens.matches<Schema>() || !commandTokens.getInteger<Schema, 1>(requestID) || !commandTokens.getInteger<Schema, 2>(handleID) || !commandTokens.getInteger<Schema, 3>(seconds))
 	{
 		return;
 	}
@@ -660,60 +891,173 @@ void Session::performPosition()
 				message.array.push_back(seconds);
 				message.array.push_back(handleID);
 				message.array.push_back(playerID);
-				message.buffer.push_back(r->second.buffer.at(0));
-				core->messages.push(message);
+				message.array.push_back(r->second.array.at(1));
+				queuedMessages.push_back(message);
 				requests.erase(r);
 			}
 		}
 	}
 }
 
-void Session::registerFile(int code)
+void Session::performManifest()
 {
-	if (!connected || !file)
+	typedef Tokenizer::Schema<2> EntrySchema;
+	typedef Tokenizer::Schema<3> EndSchema;
+	int fileID = 0;
+	if (!connected || !file || file->manifest != Pending)
 	{
 		return;
 	}
-	std::map<int, Data::File>::iterator f = core->files.find(file->id);
-	if (f != core->files.end())
+	if (commandTokens.matches<EntrySchema>())
 	{
-		if (f->second.players.find(playerID) == f->second.players.end())
+		if (commandTokens.getInteger<EntrySchema, 1>(fileID))
 		{
-			Data::Message message;
-			message.array.push_back(Data::OnTransferFile);
-			message.array.push_back(code);
-			message.array.push_back(core->packFiles);
-			message.array.push_back(++file->transferred);
-			message.array.push_back(playerID);
-			if (f->second.remote)
+			boost::shared_lock<boost::shared_mutex> lock(core->filesMutex);
+			if (static_cast<int>(file->requested.size()) < core->packFiles && core->files.find(fileID) != core->files.end())
 			{
-				std::size_t location = f->second.name.find_last_of('/');
-				message.buffer.push_back(f->second.name.substr(location + 1));
+				file->requested.insert(fileID);
 			}
-			else
+		}
+		return;
+	}
+	if (!commandTokens.matches<EndSchema>())
+	{
+		return;
+	}
+	boost::unique_lock<boost::shared_mutex> lock(core->filesMutex);
+	for (std::map<int, Data::File>::iterator f = core->files.begin(); f != core->files.end(); ++f)
+	{
+		if (file->requested.find(f->first) == file->requested.end())
+		{
+			markFile(Check, f);
+		}
+	}
+	lock.unlock();
+	file->manifest = Answered;
+	file->requested.clear();
+	sendFileData();
+}
+
+void Session::expediteTransfer()
+{
+	if (throttled && file && static_cast<std::size_t>(getTransferRate()) != transferBucket.getRate())
+	{
+		boost::system::error_code error;
+		throttleTimer.cancel(error);
+	}
+}
+
+long Session::getTransferRate() const
+{
+	long rate = 0;
+	if (pendingData.empty())
+	{
+		rate = Atomic::load(&core->sessionTransferRate);
+		if (!file->prioritized && priorityFiles.empty() && deferredPlays.empty() && Atomic::load(&core->lazyTransfer))
+		{
+			long trickleRate = Atomic::load(&core->lazyTransferRate);
+			if (trickleRate && (!rate || trickleRate < rate))
 			{
-				message.buffer.push_back(f->second.name);
+				rate = trickleRate;
 			}
-			boost::algorithm::replace_all(message.buffer.at(0), "%", "");
-			core->messages.push(message);
-			f->second.players.insert(playerID);
 		}
 	}
+	long totalRate = Atomic::load(&core->transferRate);
+	if (totalRate)
+	{
+		long share = std::max(totalRate / std::max(Atomic::load(&core->transferSessions), 1L), 1L);
+		if (!rate || share < rate)
+		{
+			rate = share;
+		}
+	}
+	return rate;
+}
+
+void Session::markFile(int code, std::map<int, Data::File>::iterator f)
+{
+	Data::File &packedFile = f->second;
+	if (playerID < 0 || playerID >= MAX_PLAYERS || packedFile.hasPlayer(playerID))
+	{
+		return;
+	}
+	Data::Message message;
+	message.array.push_back(Data::OnTransferFile);
+	message.array.push_back(code);
+	message.array.push_back(core->packFiles);
+	message.array.push_back(++file->transferred);
+	message.array.push_back(playerID);
+	if (packedFile.remote)
+	{
+		std::size_t location = packedFile.name.find_last_of('/');
+		message.buffer.push_back(packedFile.name.substr(location + 1));
+	}
+	else
+	{
+		message.buffer.push_back(packedFile.name);
+	}
+	boost::algorithm::replace_all(message.buffer.at(0), "%", "");
+	packedFile.players.set(static_cast<std::size_t>(playerID));
+	receivedFiles.push_back(f->first);
+	queuedMessages.push_back(message);
+	std::pair<std::multimap<int, std::pair<int, std::string> >::iterator, std::multimap<int, std::pair<int, std::string> >::iterator> range = deferredPlays.equal_range(f->first);
+	for (std::multimap<int, std::pair<int, std::string> >::iterator p = range.first; p != range.second; ++p)
+	{
+		if (code != Error)
+		{
+			pendingData.append(p->second.second);
+		}
+		else
+		{
+			handles.erase(p->second.first);
+		}
+	}
+	deferredPlays.erase(range.first, range.second);
+}
+
+void Session::registerFile(int code)
+{
+	if (!connected || !file)
+	{
+		return;
+	}
+	boost::unique_lock<boost::shared_mutex> lock(core->filesMutex);
+	std::map<int, Data::File>::iterator f = core->files.find(file->id);
+	if (f != core->files.end())
+	{
+		markFile(code, f);
+	}
+	lock.unlock();
 	if (downloading)
 	{
-		downloading = false;
+		setDownloading(false);
 		sendAsync("CANCEL");
 	}
-	file->handle.clear();
-	file->handle.close();
-	if (code != Local)
+	file->mapping.reset();
+	file->offset = 0;
+	file->streaming = false;
+	replayTransfers();
+	sendFileData();
+}
+
+void Session::replayTransfers()
+{
+	if (!file || file->replaying)
 	{
-		sendFileData();
+		return;
 	}
-	else
+	boost::shared_ptr<File> replayed = file;
+	replayed->replaying = true;
+	while (file == replayed && !downloading && !replayed->replies.empty())
 	{
-		startTransferTimer();
+		std::string reply = replayed->replies.front();
+		replayed->replies.pop_front();
+		if (commandTokens.parse(Framer::Line(reply.data(), reply.data() + reply.size())))
+		{
+			performTransfer();
+		}
 	}
+	replayed->replaying = false;
 }
 
 void Session::sendFileData()
@@ -722,48 +1066,148 @@ void Session::sendFileData()
 	{
 		return;
 	}
-	if (file->transferred == core->packFiles)
+	if (file->manifest != Answered)
+	{
+		if (file->manifest == Unsent && Atomic::load(&core->manifestBatching) && sendManifest())
+		{
+			return;
+		}
+		if (file->manifest == Pending)
+		{
+			return;
+		}
+		file->manifest = Answered;
+	}
+	std::size_t window = static_cast<std::size_t>(Atomic::load(&core->transferWindow));
+	boost::shared_lock<boost::shared_mutex> lock(core->filesMutex);
+	while (file->offers.size() < window && (!priorityFiles.empty() || !file->pending.empty()))
+	{
+		bool prioritized = !priorityFiles.empty();
+		std::deque<int> &queue = prioritized ? priorityFiles : file->pending;
+		std::map<int, Data::File>::iterator f = core->files.find(queue.front());
+		queue.pop_front();
+		if (f != core->files.end())
+		{
+			offerFile(f, prioritized);
+		}
+	}
+	lock.unlock();
+	if (file->offers.empty())
 	{
 		stopTransfer();
-		sendAsync(boost::str(boost::format("%1%\n") % Server::Transfer));
+		sendAsync(Encoder(Server::Transfer));
+		return;
+	}
+	flushAsync();
+}
+
+void Session::offerFile(std::map<int, Data::File>::iterator f, bool prioritized)
+{
+	if (f->second.hasPlayer(playerID))
+	{
 		return;
 	}
+	for (std::deque<Offer>::iterator o = file->offers.begin(); o != file->offers.end(); ++o)
+	{
+		if (o->id == f->first)
+		{
+			return;
+		}
+	}
+	Offer offer;
+	offer.id = f->first;
+	offer.path = "audiopacks/" + core->packName + "/" + f->second.name;
+	offer.prioritized = prioritized;
+	offer.remote = f->second.remote;
+	offer.size = f->second.size;
+	file->offers.push_back(offer);
+	stageAsync(Encoder(Server::Transfer) << static_cast<int>(core->packTransferable) << f->first << f->second.name << static_cast<unsigned long>(f->second.size) << Encoder::Hex(f->second.checksum));
+}
+
+bool Session::sendManifest()
+{
+	std::size_t entries = 0;
+	boost::shared_lock<boost::shared_mutex> lock(core->filesMutex);
 	for (std::map<int, Data::File>::iterator f = core->files.begin(); f != core->files.end(); ++f)
 	{
-		if (f->second.players.find(playerID) == f->second.players.end())
+		if (!f->second.hasPlayer(playerID))
 		{
-			if (!f->second.remote)
-			{
-				std::string path = boost::str(boost::format("audiopacks/%1%/%2%") % core->packName % f->second.name);
-				file->handle.open(path.c_str(), std::ios_base::in | std::ios_base::binary);
-				if (!file->handle)
-				{
-					registerFile(Error);
-					return;
-				}
-			}
-			file->id = f->first;
-			file->size = f->second.size;
-			sendAsync(boost::str(boost::format("%d\t%d\t%d\t%s\t%lu\t%X\n") % Server::Transfer % core->packTransferable % f->first % f->second.name % f->second.size % f->second.checksum));
-			break;
+			stageAsync(Encoder(Server::Manifest) << static_cast<int>(core->packTransferable) << f->first << f->second.name << static_cast<unsigned long>(f->second.size) << Encoder::Hex(f->second.checksum));
+			++entries;
 		}
 	}
+	lock.unlock();
+	if (!entries)
+	{
+		return false;
+	}
+	file->manifest = Pending;
+	sendAsync(Encoder(Server::Manifest));
+	return true;
+}
+
+void Session::setDownloading(bool enabled)
+{
+	if (downloading != enabled)
+	{
+		downloading = enabled;
+		Atomic::fetchAdd(&core->transferSessions, enabled ? 1 : -1);
+	}
 }
 
 void Session::transferFile()
 {
-	if (!connected || !downloading || !file)
+	if (!connected || !downloading || !file || throttled)
 	{
 		return;
 	}
-	if (file->handle)
+	if (!file->streaming && !pendingData.empty())
 	{
-		file->handle.read(file->buffer.c_array(), static_cast<std::streamsize>(file->buffer.size()));
-		boost::asio::async_write(sessionSocket, boost::asio::buffer(file->buffer.c_array(), static_cast<std::size_t>(file->handle.gcount())), boost::bind(&Session::handleWriteFile, shared_from_this(), boost::asio::placeholders::error));
+		flushAsync();
+		return;
 	}
-	else
+	if (file->mapping && static_cast<std::size_t>(file->offset) < file->mapping->getSize())
 	{
-		downloading = false;
-		registerFile(Local);
+		std::size_t length = std::min(static_cast<std::size_t>(Atomic::load(&core->transferChunk)), file->mapping->getSize() - static_cast<std::size_t>(file->offset));
+		transferBucket.setRate(static_cast<std::size_t>(getTransferRate()));
+		length = transferBucket.take(length);
+		if (!length)
+		{
+			startThrottleTimer();
+			return;
+		}
+		file->streaming = true;
+		#if defined __LINUX__
+			boost::system::error_code error;
+			sessionSocket.native_non_blocking(true, error);
+			if (error)
+			{
+				registerFile(Error);
+				return;
+			}
+			ssize_t result = ::sendfile(sessionSocket.native_handle(), file->mapping->getDescriptor(), &file->offset, length);
+			if (!result || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			{
+				registerFile(Error);
+				return;
+			}
+			std::size_t sent = result > 0 ? static_cast<std::size_t>(result) : 0;
+			if (sent < length)
+			{
+				transferBucket.give(length - sent);
+			}
+			transferredBytes += static_cast<boost::uint64_t>(sent);
+			writeInProgress = true;
+			sessionSocket.async_write_some(boost::asio::null_buffers(), strand.wrap(boost::bind(&Session::handleWriteFile, shared_from_this(), boost::asio::placeholders::error, file->mapping)));
+		#else
+			writeInProgress = true;
+			boost::asio::async_write(sessionSocket, boost::asio::buffer(file->mapping->getData() + file->offset, length), strand.wrap(boost::bind(&Session::handleWriteFile, shared_from_this(), boost::asio::placeholders::error, file->mapping)));
+			file->offset += length;
+			transferredBytes += static_cast<boost::uint64_t>(length);
+		#endif
+		return;
 	}
+	transferredTime += boost::chrono::steady_clock::now() - file->start;
+	setDownloading(false);
+	registerFile(Local);
 }
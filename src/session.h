@@ -17,17 +17,28 @@
 #ifndef SESSION_H
 #define SESSION_H
 
+#include "bucket.h"
 #include "common.h"
 #include "data.h"
+#include "encoder.h"
+#include "framer.h"
+#include "tokenizer.h"
 
-#include <boost/array.hpp>
 #include <boost/asio.hpp>
+#include <boost/chrono/chrono.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 
-#include <fstream>
+#include <sdk/plugin.h>
+
+#if defined __LINUX__
+	#include <sys/types.h>
+#endif
+
+#include <deque>
 #include <map>
-#include <queue>
 #include <set>
 #include <string>
 #include <vector>
@@ -39,33 +50,51 @@ class Session : public boost::enable_shared_from_this<Session>
 public:
 	Session(boost::asio::io_service &io_service);
 
+	void flushAsync();
+	void sendAsync(const Encoder &encoder);
 	void sendAsync(const std::string &buffer);
+	void stageAsync(const Encoder &encoder);
 	void startAsync();
 	void stopAsync();
 
+	bool cancelPlay(int handleID);
+	void clearReceivedFiles();
+	bool deferCommand(int handleID, const Encoder &encoder);
+	bool deferPlay(int fileID, int handleID, const Encoder &encoder);
+	void prioritizeFile(int fileID);
+
+	void beginTransferAsync();
 	void startTransfer();
 	void stopTransfer();
 
 	bool connected;
 	bool downloading;
 	std::set<int> handles;
+	boost::mutex mutex;
 	int playerID;
 	std::string playerName;
 	std::map<int, Data::Message> requests;
+	bool staged;
+	boost::uint64_t transferredBytes;
+	boost::chrono::steady_clock::duration transferredTime;
 	bool transferring;
 private:
+	void handleBeginTransfer();
 	void handleRead(const boost::system::error_code &error, std::size_t transferredBytes);
 	void handleHeartbeatTimer(const boost::system::error_code &error);
+	void handleThrottleTimer(const boost::system::error_code &error);
 	void handleTransferTimer(const boost::system::error_code &error);
 	void handleWrite(const boost::system::error_code &error);
-	void handleWriteFile(const boost::system::error_code &error);
+	void handleWriteFile(const boost::system::error_code &error, SharedMapping mapping);
 
 	void startHeartbeatTimer();
+	void startThrottleTimer();
 	void startTransferTimer();
 	void stopHeartbeatTimer();
 	void stopTransferTimer();
 
-	void parseBuffer(const std::string &buffer);
+	void parseBuffer(const Framer::Line &buffer);
+	void publishMessages(boost::mutex::scoped_lock &lock);
 
 	void performAuthenticate();
 	void performTransfer();
@@ -75,9 +104,18 @@ private:
 	void performRadioStation();
 	void performTrack();
 	void performPosition();
+	void performManifest();
 
+	void beginTransfer();
+	void expediteTransfer();
+	long getTransferRate() const;
+	void markFile(int code, std::map<int, Data::File>::iterator f);
+	void offerFile(std::map<int, Data::File>::iterator f, bool prioritized);
 	void registerFile(int code);
+	void replayTransfers();
 	void sendFileData();
+	bool sendManifest();
+	void setDownloading(bool enabled);
 	void transferFile();
 
 	enum Commands
@@ -89,7 +127,8 @@ private:
 		Stop,
 		RadioStation,
 		Track,
-		Position
+		Position,
+		Manifest
 	};
 
 	enum PlayCodes
@@ -106,29 +145,69 @@ private:
 		Error
 	};
 
+	enum ManifestStates
+	{
+		Unsent,
+		Pending,
+		Answered
+	};
+
+	struct Offer
+	{
+		Offer();
+
+		int id;
+		std::string path;
+		bool prioritized;
+		bool remote;
+		std::size_t size;
+	};
+
 	struct File
 	{
 		File();
 
-		boost::array<char, MAX_BUFFER> buffer;
 		int id;
-		std::fstream handle;
+		int manifest;
+		SharedMapping mapping;
+		std::deque<Offer> offers;
+		std::deque<int> pending;
+		bool prioritized;
+		#if defined __LINUX__
+			off_t offset;
+		#else
+			std::size_t offset;
+		#endif
+		// Transfer replies that arrived during a download, at most one per offer
+		bool replaying;
+		std::deque<std::string> replies;
+		std::set<int> requested;
 		std::size_t size;
+		boost::chrono::steady_clock::time_point start;
+		// Cleared until the first chunk goes out; commands queued before it still flush
+		bool streaming;
 		int transferred;
 	};
 
 	boost::shared_ptr<File> file;
 
-	std::vector<std::string> commandTokens;
+	Tokenizer commandTokens;
+	std::multimap<int, std::pair<int, std::string> > deferredPlays;
 	boost::asio::deadline_timer heartbeatTimer;
-	std::vector<std::string> messageTokens;
 	bool missedResponse;
-	std::queue<std::string> pendingMessages;
-	char receivedData[MAX_BUFFER];
+	std::string pendingData;
+	std::deque<int> priorityFiles;
+	std::vector<Data::Message> queuedMessages;
+	Framer receivedData;
+	std::vector<int> receivedFiles;
 	std::string sentData;
 	std::string sessionAddress;
 	unsigned short sessionPort;
 	boost::asio::ip::tcp::socket sessionSocket;
+	boost::asio::io_service::strand strand;
+	boost::asio::deadline_timer throttleTimer;
+	bool throttled;
+	Bucket transferBucket;
 	boost::asio::deadline_timer transferTimer;
 	bool waitingForResponse;
 	bool writeInProgress;
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "tokenizer.h"
+
+#include <boost/cstdint.hpp>
+
+#include <cstring>
+#include <limits>
+
+Tokenizer::Tokenizer()
+{
+	count = 0;
+}
+
+bool Tokenizer::parse(const Framer::Line &line)
+{
+	count = 0;
+	const char *begin = line.begin();
+	while (true)
+	{
+		const char *end = static_cast<const char*>(std::memchr(begin, '\t', static_cast<std::size_t>(line.end() - begin)));
+		if (!end)
+		{
+			end = line.end();
+		}
+		if (begin == end || count == MaxTokens)
+		{
+			count = 0;
+			return false;
+		}
+		tokens[count++] = Framer::Line(begin, end);
+		if (end == line.end())
+		{
+			break;
+		}
+		begin = end + 1;
+	}
+	return count >= MinTokens;
+}
+
+bool Tokenizer::parseHex(const Framer::Line &token, boost::uint32_t &value)
+{
+	if (token.empty() || token.size() > 8)
+	{
+		return false;
+	}
+	boost::uint32_t result = 0;
+	for (const char *c = token.begin(); c != token.end(); ++c)
+	{
+		boost::uint32_t digit = 0;
+		if (*c >= '0' && *c <= '9')
+		{
+			digit = static_cast<boost::uint32_t>(*c - '0');
+		}
+		else if (*c >= 'A' && *c <= 'F')
+		{
+			digit = static_cast<boost::uint32_t>(*c - 'A' + 10);
+		}
+		else if (*c >= 'a' && *c <= 'f')
+		{
+			digit = static_cast<boost::uint32_t>(*c - 'a' + 10);
+		}
+		else
+		{
+			return false;
+		}
+		result = (result << 4) | digit;
+	}
+	value = result;
+	return true;
+}
+
+bool Tokenizer::parseInteger(const Framer::Line &token, int &value)
+{
+	const char *c = token.begin();
+	bool negative = false;
+	if (c != token.end() && (*c == '-' || *c == '+'))
+	{
+		negative = (*c++ == '-');
+	}
+	if (c == token.end())
+	{
+		return false;
+	}
+	unsigned long limit = negative ? static_cast<unsigned long>(std::numeric_limits<int>::max()) + 1 : static_cast<unsigned long>(std::numeric_limits<int>::max());
+	unsigned long result = 0;
+	for (; c != token.end(); ++c)
+	{
+		if (*c < '0' || *c > '9')
+		{
+			return false;
+		}
+		unsigned long digit = static_cast<unsigned long>(*c - '0');
+		if (result > (limit - digit) / 10)
+		{
+			return false;
+		}
+		result = result * 10 + digit;
+	}
+	value = negative && result ? -static_cast<int>(result - 1) - 1 : static_cast<int>(result);
+	return true;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2012 Incognito
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include "framer.h"
+
+#include <boost/array.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/static_assert.hpp>
+
+/*
+ * Splits a received line on tabs without copying. Each command handler
+ * declares a Schema with its token count; reading a token outside of it
+ * fails to compile.
+ */
+
+class Tokenizer
+{
+public:
+	enum
+	{
+		MinTokens = 2,
+		MaxTokens = 4
+	};
+
+	template <std::size_t Count>
+	struct Schema
+	{
+		BOOST_STATIC_ASSERT(Count >= MinTokens && Count <= MaxTokens);
+
+		static const std::size_t tokens = Count;
+	};
+
+	Tokenizer();
+
+	bool parse(const Framer::Line &line);
+
+	inline bool getCommand(int &value) const
+	{
+		return parseInteger(tokens[0], value);
+	}
+
+	template <typename S>
+	inline bool matches() const
+	{
+		return count == S::tokens;
+	}
+
+	template <typename S, std::size_t Index>
+	inline const Framer::Line &getString() const
+	{
+		BOOST_STATIC_ASSERT(Index < S::tokens);
+		return tokens[Index];
+	}
+
+	template <typename S, std::size_t Index>
+	inline bool getInteger(int &value) const
+	{
+		BOOST_STATIC_ASSERT(Index < S::tokens);
+		return parseInteger(tokens[Index], value);
+	}
+
+	template <typename S, std::size_t Index>
+	inline bool getHex(boost::uint32_t &value) const
+	{
+		BOOST_STATIC_ASSERT(Index < S::tokens);
+		return parseHex(tokens[Index], value);
+	}
+
+	static bool parseHex(const Framer::Line &token, boost::uint32_t &value);
+	static bool parseInteger(const Framer::Line &token, int &value);
+private:
+	std::size_t count;
+	boost::array<Framer::Line, MaxTokens> tokens;
+};
+
+#endif